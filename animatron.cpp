@@ -12,6 +12,182 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
 
+static bool EntityHasTimeDependentState(const Data::Entity& entity)
+{
+    switch (entity.data._index)
+    {
+        #include "df_serialize/df_serialize/_common.h"
+        #define VARIANT_TYPE(_TYPE, _NAME, _DEFAULT, _DESCRIPTION) \
+            case Data::EntityVariant::c_index_##_NAME: return _TYPE##_Action::HasTimeDependentState(entity);
+        #include "df_serialize/df_serialize/_fillunsetdefines.h"
+        #include "schemas/schemas_entities.h"
+        default: return true;
+    }
+}
+
+// Gets the frames whose times could be within [startTime, endTime], clamped to the frames of the document.
+// The rounding is conservative, so this can give a frame too many on each side, but never misses one.
+// The range is empty if firstFrame > lastFrame.
+static void TimeRangeToFrameRange(const Data::Document& document, float startTime, float endTime, int& firstFrame, int& lastFrame)
+{
+    int framesTotal = TotalFrameCount(document);
+
+    double startFrame = (double(startTime) - double(document.startTime)) * double(document.FPS);
+    double endFrame = (double(endTime) - double(document.startTime)) * double(document.FPS);
+    startFrame = Clamp(startFrame, -2.0, double(framesTotal + 1));
+    endFrame = Clamp(endFrame, -2.0, double(framesTotal + 1));
+
+    firstFrame = Max(int(floor(startFrame)), 0);
+    lastFrame = Min(int(ceil(endFrame)), framesTotal - 1);
+}
+
+// Put each entity timeline into the buckets of frames that it exists in, so that rendering a frame
+// only needs to look at the timelines that could exist, instead of every timeline in the document.
+// The buckets keep the zorder sorting of document.runtimeEntityTimelines.
+static void MakeEntityTimelineBuckets(Data::Document& document)
+{
+    document.runtimeEntityTimelineBuckets.clear();
+
+    int framesTotal = TotalFrameCount(document);
+    if (framesTotal < 1)
+        return;
+
+    document.timelineBucketFrames = Max(document.FPS, 1);
+    document.runtimeEntityTimelineBuckets.resize((framesTotal + document.timelineBucketFrames - 1) / document.timelineBucketFrames);
+
+    for (Data::RuntimeEntityTimeline* timeline : document.runtimeEntityTimelines)
+    {
+        float lifetimeEnd = (timeline->destroyTime >= 0.0f) ? timeline->destroyTime : FLT_MAX;
+
+        int firstFrame, lastFrame;
+        TimeRangeToFrameRange(document, timeline->createTime, lifetimeEnd, firstFrame, lastFrame);
+        if (firstFrame > lastFrame)
+            continue;
+
+        for (int bucketIndex = firstFrame / document.timelineBucketFrames; bucketIndex <= lastFrame / document.timelineBucketFrames; ++bucketIndex)
+            document.runtimeEntityTimelineBuckets[bucketIndex].timelines.push_back(timeline);
+    }
+}
+
+// Returns the timelines that could exist during this frame, in zorder
+static const std::vector<Data::RuntimeEntityTimeline*>& GetFrameEntityTimelines(const Data::Document& document, int frameIndex)
+{
+    // Frames outside of the document duration aren't bucketed, so need to look at everything
+    int bucketIndex = (document.timelineBucketFrames > 0 && frameIndex >= 0) ? frameIndex / document.timelineBucketFrames : -1;
+    if (bucketIndex < 0 || bucketIndex >= (int)document.runtimeEntityTimelineBuckets.size())
+        return document.runtimeEntityTimelines;
+
+    return document.runtimeEntityTimelineBuckets[bucketIndex].timelines;
+}
+
+// Find the ranges of frames where nothing visible can change, by looking at entity lifetimes and keyframes.
+// Only one frame in each range needs to be evaluated. The rest can be recycled from it without any per frame work.
+static void MakeStaticFrameRanges(Data::Document& document)
+{
+    document.staticFrameRanges.clear();
+
+    int framesTotal = TotalFrameCount(document);
+    if (framesTotal < 2)
+        return;
+
+    // frameChanges[i] is > 0 when something may change between frame i and frame i+1.
+    // It's filled out as a difference array, and then summed up below.
+    std::vector<int> frameChanges(framesTotal, 0);
+    auto MarkChange = [&](float startTime, float endTime)
+    {
+        // a change in the time span can be seen by the frame pair straddling its start, and all the pairs after that, up to its end
+        int firstFrame, lastFrame;
+        TimeRangeToFrameRange(document, startTime, endTime, firstFrame, lastFrame);
+        int firstPair = Max(firstFrame - 1, 0);
+        int lastPair = Min(lastFrame, framesTotal - 2);
+        if (firstPair > lastPair)
+            return;
+
+        frameChanges[firstPair]++;
+        frameChanges[lastPair + 1]--;
+    };
+
+    for (const Data::RuntimeEntityTimeline* timeline : document.runtimeEntityTimelines)
+    {
+        float lifetimeEnd = (timeline->destroyTime >= 0.0f) ? timeline->destroyTime : FLT_MAX;
+
+        // the entity appearing and disappearing are changes
+        MarkChange(timeline->createTime, timeline->createTime);
+        if (timeline->destroyTime >= 0.0f)
+            MarkChange(timeline->destroyTime, timeline->destroyTime);
+
+        // if the entity can change over time on its own (like a flipbook), it can change at any point in its lifetime
+        bool timeDependent = false;
+        for (const Data::RuntimeEntityTimelineKeyframe& keyFrame : timeline->keyFrames)
+            timeDependent = timeDependent || EntityHasTimeDependentState(keyFrame.entity);
+        if (timeDependent)
+        {
+            MarkChange(timeline->createTime, lifetimeEnd);
+            continue;
+        }
+
+        // Each keyframe is a change, and so is the time between two keyframes, unless they interpolate to a constant value.
+        // That happens when the keyframes have the same entity values, or when the blend control points are all the same.
+        for (size_t index = 1; index < timeline->keyFrames.size(); ++index)
+        {
+            const Data::RuntimeEntityTimelineKeyframe& keyFrame0 = timeline->keyFrames[index - 1];
+            const Data::RuntimeEntityTimelineKeyframe& keyFrame1 = timeline->keyFrames[index];
+
+            MarkChange(keyFrame1.time, keyFrame1.time);
+
+            const Data::CubicBezierControlPoints1D& CPs = keyFrame1.blendControlPoints;
+            if (CPs.A == CPs.B && CPs.A == CPs.C && CPs.A == CPs.D)
+                continue;
+
+            size_t hash0 = 0;
+            size_t hash1 = 0;
+            Hash(hash0, keyFrame0.entity);
+            Hash(hash1, keyFrame1.entity);
+            if (hash0 == hash1)
+                continue;
+
+            MarkChange(keyFrame0.time, keyFrame1.time);
+        }
+    }
+
+    // make a range out of each run of frames that have no changes between them
+    int changes = 0;
+    int rangeStart = 0;
+    for (int frameIndex = 0; frameIndex < framesTotal; ++frameIndex)
+    {
+        changes += frameChanges[frameIndex];
+        if (changes > 0 || frameIndex == framesTotal - 1)
+        {
+            if (frameIndex > rangeStart)
+                document.staticFrameRanges.push_back(Data::RuntimeFrameRange{ rangeStart, frameIndex });
+            rangeStart = frameIndex + 1;
+        }
+    }
+}
+
+// Returns the index into document.staticFrameRanges that the frame is in, or -1 if it isn't in one
+static int GetStaticFrameRangeIndex(const Data::Document& document, int frameIndex)
+{
+    auto it = std::upper_bound(
+        document.staticFrameRanges.begin(),
+        document.staticFrameRanges.end(),
+        frameIndex,
+        [](int frameIndex, const Data::RuntimeFrameRange& range)
+        {
+            return frameIndex < range.firstFrame;
+        }
+    );
+
+    if (it == document.staticFrameRanges.begin())
+        return -1;
+    --it;
+
+    if (frameIndex > it->lastFrame)
+        return -1;
+
+    return int(it - document.staticFrameRanges.begin());
+}
+
 bool ValidateAndFixupDocument(Data::Document& document)
 {
     // make sure the build folder exists
@@ -76,9 +252,6 @@ bool ValidateAndFixupDocument(Data::Document& document)
             document.samplesPerPixel = 1;
     }
 
-    // Make the sampling jitter sequence for the document
-    MakeJitterSequence(document);
-
     // Load blue noise texture for dithering or dissolve etc
     {
         int blueNoiseComponents = 0;
@@ -130,6 +303,12 @@ bool ValidateAndFixupDocument(Data::Document& document)
         printf("Could not init CAS\n");
         return false;
     }
+    CAS::Get().SetMemoryBudget(size_t(Max(document.config.casMemoryMB, 0)) * 1024 * 1024);
+
+    // Make the sampling jitter sequence for the document. It's cached in the CAS, so this happens after the CAS is
+    // initialized, and after the blue noise texture is loaded, which the rotated sequences use when rendering.
+    if (!MakeJitterSequence(document))
+        return false;
 
     // make a timeline for each entity by just starting with the entity definition
     
@@ -213,6 +392,13 @@ bool ValidateAndFixupDocument(Data::Document& document)
         );
     }
 
+    // index the timelines by time, and find the frames that don't need to be evaluated
+    MakeEntityTimelineBuckets(document);
+    MakeStaticFrameRanges(document);
+
+    // make any latex images that aren't in the CAS yet, so rendering doesn't have to wait on latex
+    PrefetchLatexImages(document);
+
     return true;
 }
 
@@ -220,6 +406,19 @@ bool RenderFrame(const Data::Document& document, int frameIndex, ThreadContext&
 {
     std::vector<Data::ColorPMA>& pixels = threadContext.pixelsPMA;
 
+    // if this frame is in a static range of frames, and one of those frames is already rendered, recycle it without doing any work
+    int staticFrameRangeIndex = GetStaticFrameRangeIndex(document, frameIndex);
+    if (staticFrameRangeIndex >= 0 && context.frameCache.GetStaticFrameRangeHash(staticFrameRangeIndex, frameHash))
+    {
+        const FrameCache::FrameData& recycleFrame = context.frameCache.GetFrame(frameHash);
+        recycledFrameIndex = recycleFrame.frameIndex;
+        if (recycleFrame.frameIndex >= 0)
+        {
+            threadContext.pixelsU8 = recycleFrame.pixels;
+            return true;
+        }
+    }
+
     // setup for the frame
     float frameTime = FrameIndexToSeconds(document, frameIndex);
     EntityActionFrameContext frameContext;
@@ -233,8 +432,9 @@ bool RenderFrame(const Data::Document& document, int frameIndex, ThreadContext&
     Hash(frameHash, document.renderSizeX);
     Hash(frameHash, document.renderSizeY);
     std::unordered_map<std::string, Data::Entity> entityMap;
+    const std::vector<Data::RuntimeEntityTimeline*>& frameTimelines = GetFrameEntityTimelines(document, frameIndex);
     {
-        for (const Data::RuntimeEntityTimeline* timeline_ : document.runtimeEntityTimelines)
+        for (const Data::RuntimeEntityTimeline* timeline_ : frameTimelines)
         {
             // skip any entity that doesn't currently exist
             const Data::RuntimeEntityTimeline& timeline = *timeline_;
@@ -312,6 +512,10 @@ bool RenderFrame(const Data::Document& document, int frameIndex, ThreadContext&
         }
     }
 
+    // let the other frames in the static range know what the hash is
+    if (staticFrameRangeIndex >= 0)
+        context.frameCache.SetStaticFrameRangeHash(staticFrameRangeIndex, frameHash);
+
     // if we have already rendered a frame with this hash, just copy that file
     {
         const FrameCache::FrameData& recycleFrame = context.frameCache.GetFrame(frameHash);
@@ -326,7 +530,7 @@ bool RenderFrame(const Data::Document& document, int frameIndex, ThreadContext&
     // otherwise, render it again
 
     // process the entities in zorder
-    for (const Data::RuntimeEntityTimeline* timeline_ : document.runtimeEntityTimelines)
+    for (const Data::RuntimeEntityTimeline* timeline_ : frameTimelines)
     {
         // skip any entity that doesn't currently exist
         const Data::RuntimeEntityTimeline& timeline = *timeline_;
@@ -38,6 +38,7 @@ public:
 
         m_frameData.clear();
         m_frames.clear();
+        m_staticFrameRangeHashes.clear();
 
         omp_unset_lock(&m_lock);
     }
@@ -69,9 +70,33 @@ public:
         omp_unset_lock(&m_lock);
     }
 
+    // Every frame in a static frame range has the same hash, so once one of them knows it, the rest can be recycled without evaluating anything
+    bool GetStaticFrameRangeHash(int rangeIndex, size_t& hash)
+    {
+        omp_set_lock(&m_lock);
+
+        auto it = m_staticFrameRangeHashes.find(rangeIndex);
+        bool found = (it != m_staticFrameRangeHashes.end());
+        if (found)
+            hash = it->second;
+
+        omp_unset_lock(&m_lock);
+        return found;
+    }
+
+    void SetStaticFrameRangeHash(int rangeIndex, size_t hash)
+    {
+        omp_set_lock(&m_lock);
+
+        m_staticFrameRangeHashes[rangeIndex] = hash;
+
+        omp_unset_lock(&m_lock);
+    }
+
 private:
     omp_lock_t m_lock;
     std::unordered_map<size_t, size_t> m_frames;  // map frame hash to m_frameData index
+    std::unordered_map<int, size_t> m_staticFrameRangeHashes; // map document.staticFrameRanges index to the frame hash of that range
     std::vector<FrameData> m_frameData;
 };
 
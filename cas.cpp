@@ -1,116 +1,1365 @@
 #include "cas.h"
+#include "compression.h"
+#include "utils.h"
 #include <direct.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// A pack file is a PackHeader, then the data of each entry, then the index.
+// The index is a hash table of PackIndexEntry, with a power of 2 number of slots, using linear probing.
+// Version 2 added rawSize to the index, for compressed data.
+static const uint32_t c_packMagic = 0x4B434150; // "PACK"
+static const uint32_t c_packVersion = 2;
+static const size_t c_packAlignment = 16;
+
+static const char* c_accessTimesFileName = "build/CAS/access.times";
+
+// A lock file for making a key is taken over if the process that made it is gone, or it's older than this
+static const int c_makeLockStaleSeconds = 600;
+static const int c_makeLockPollMilliseconds = 50;
+
+// Misses that are never set or cancelled are forgotten when a shard has this many, so they don't pile up
+static const size_t c_maxMissTimesPerShard = 1024;
+
+// how often a miss looks for pack files written by other processes
+static const int c_packRescanMilliseconds = 1000;
+
+// how long the background writer waits for more data to be set before writing, so it goes into the same pack file
+static const int c_writeDelaySeconds = 2;
+
+struct PackHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t entryCount;
+	uint64_t indexOffset;
+	uint64_t indexSlotCount;
+};
+
+struct PackIndexEntry
+{
+	uint64_t key;
+	uint64_t offset; // 0 means the slot is empty
+	uint64_t size; // the size in the pack
+	uint64_t rawSize; // the size after decompressing. The data is compressed if this is different than size.
+};
+
+// version 1 index entries don't have rawSize, and the data isn't compressed
+static size_t GetIndexEntrySize(uint32_t version)
+{
+	return (version == 1) ? sizeof(uint64_t) * 3 : sizeof(PackIndexEntry);
+}
+
+static PackIndexEntry GetIndexEntry(const unsigned char* packData, const PackHeader& header, uint64_t slot)
+{
+	PackIndexEntry entry;
+	size_t entrySize = GetIndexEntrySize(header.version);
+	memcpy(&entry, &packData[header.indexOffset + slot * entrySize], entrySize);
+	if (header.version == 1)
+		entry.rawSize = entry.size;
+	return entry;
+}
+
+// returns the names of the files in the directory which end with the extension
+static std::vector<std::string> ListFiles(const char* directory, const char* extension)
+{
+	std::vector<std::string> ret;
+	size_t extensionLength = strlen(extension);
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA findData;
+	HANDLE find = FindFirstFileA((std::string(directory) + "/*" + extension).c_str(), &findData);
+	if (find == INVALID_HANDLE_VALUE)
+		return ret;
+	do
+	{
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			ret.push_back(findData.cFileName);
+	}
+	while (FindNextFileA(find, &findData));
+	FindClose(find);
+#else
+	DIR* dir = opendir(directory);
+	if (!dir)
+		return ret;
+	while (dirent* entry = readdir(dir))
+		ret.push_back(entry->d_name);
+	closedir(dir);
+#endif
+
+	ret.erase(std::remove_if(ret.begin(), ret.end(),
+		[extensionLength, extension](const std::string& name)
+		{
+			return name.length() <= extensionLength || strcmp(&name[name.length() - extensionLength], extension) != 0;
+		}
+	), ret.end());
+
+	return ret;
+}
+
+static bool MapFile(const char* fileName, const unsigned char*& data, size_t& size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	// the view keeps the mapping and file alive after their handles are closed
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		return false;
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view)
+		return false;
+
+	data = (const unsigned char*)view;
+	size = (size_t)fileSize.QuadPart;
+	return true;
+#else
+	int file = open(fileName, O_RDONLY);
+	if (file < 0)
+		return false;
+
+	struct stat fileStat;
+	if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0)
+	{
+		close(file);
+		return false;
+	}
+
+	// the mapping keeps the file alive after it is closed
+	void* view = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	if (view == MAP_FAILED)
+		return false;
+
+	data = (const unsigned char*)view;
+	size = (size_t)fileStat.st_size;
+	return true;
+#endif
+}
+
+static void UnmapFile(const unsigned char* data, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void*)data, size);
+#endif
+}
+
+static void GetPackFileName(char* fileName, size_t fileNameSize, unsigned int number)
+{
+	sprintf_s(fileName, fileNameSize, "build/CAS/%08u.pack", number);
+}
+
+// Files are written to a temporary name first. The name starts with the process id, so temporary files left behind by
+// a process that died can be found.
+static std::string MakeTempFileName()
+{
+	static std::atomic<unsigned int> s_tempFileCount(0);
+	char fileName[1024];
+	sprintf_s(fileName, "build/CAS/%i_%u.tmp", GetPID(), s_tempFileCount++);
+	return fileName;
+}
+
+// Gives a finished temporary file its final name. Fails instead of replacing the file if it already exists.
+static bool PublishFile(const char* tempFileName, const char* fileName)
+{
+#ifdef _WIN32
+	return MoveFileExA(tempFileName, fileName, 0) != 0;
+#else
+	if (link(tempFileName, fileName) != 0)
+		return false;
+	unlink(tempFileName);
+	return true;
+#endif
+}
+
+// Gives a finished temporary file its final name, replacing the file that is there. Readers see either the whole old
+// file or the whole new file.
+static bool ReplaceWithFile(const char* tempFileName, const char* fileName)
+{
+#ifdef _WIN32
+	return MoveFileExA(tempFileName, fileName, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(tempFileName, fileName) == 0;
+#endif
+}
+
+// Creates a file, only if it doesn't already exist
+static bool CreateFileExclusive(const char* fileName, const std::string& contents)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	DWORD written = 0;
+	WriteFile(file, contents.data(), (DWORD)contents.size(), &written, nullptr);
+	CloseHandle(file);
+	return true;
+#else
+	int file = open(fileName, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (file < 0)
+		return false;
+	ssize_t written = write(file, contents.data(), contents.size());
+	(void)written;
+	close(file);
+	return true;
+#endif
+}
+
+// Returns how many seconds ago the file was modified, or -1 if it doesn't exist
+static double GetFileAge(const char* fileName)
+{
+#ifdef _WIN32
+	struct _stat64 fileStat;
+	if (_stat64(fileName, &fileStat) != 0)
+		return -1.0;
+#else
+	struct stat fileStat;
+	if (stat(fileName, &fileStat) != 0)
+		return -1.0;
+#endif
+	return Max(difftime(time(nullptr), fileStat.st_mtime), 0.0);
+}
+
+static bool IsProcessRunning(int pid)
+{
+#ifdef _WIN32
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+	if (!process)
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	bool running = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return running;
+#else
+	return kill(pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+static void GetLockFileName(char* fileName, size_t fileNameSize, size_t key)
+{
+	sprintf_s(fileName, fileNameSize, "build/CAS/%zu.lock", key);
+}
+
+// A lock file holds the id of the process that made it
+static bool IsLockStale(const char* fileName)
+{
+	double age = GetFileAge(fileName);
+	if (age < 0.0)
+		return false;
+	if (age > double(c_makeLockStaleSeconds))
+		return true;
+
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "rb");
+	if (!file)
+		return false;
+	char buffer[32] = {};
+	fread(buffer, 1, sizeof(buffer) - 1, file);
+	fclose(file);
+
+	// the process may not have written its id yet
+	int pid = atoi(buffer);
+	return pid != 0 && !IsProcessRunning(pid);
+}
+
+static int64_t GetMilliseconds()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool CAS::LoadPacks()
+{
+	std::vector<std::string> fileNames = ListFiles("build/CAS", ".pack");
+
+	// only take the exclusive lock if there are new packs, so lookups in the packs aren't blocked for nothing
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(m_packsLock);
+		bool anyNew = false;
+		for (const std::string& fileName : fileNames)
+			anyNew |= m_seenPackNumbers.count((unsigned int)strtoul(fileName.c_str(), nullptr, 10)) == 0;
+		if (!anyNew)
+			return false;
+	}
+
+	std::unique_lock<std::shared_timed_mutex> lock(m_packsLock);
+	bool loadedAny = false;
+	for (const std::string& fileName : fileNames)
+	{
+		Pack pack;
+		pack.number = (unsigned int)strtoul(fileName.c_str(), nullptr, 10);
+		if (!m_seenPackNumbers.insert(pack.number).second)
+			continue;
+		m_nextPackNumber = std::max(m_nextPackNumber, pack.number + 1);
+
+		// another process may have deleted it since the files were listed
+		std::string path = "build/CAS/" + fileName;
+		if (!MapFile(path.c_str(), pack.data, pack.size))
+			continue;
+
+		// make sure the pack is one we can read. The index needs a power of 2 number of slots, with at least one empty.
+		const PackHeader& header = *(const PackHeader*)pack.data;
+		if (pack.size < sizeof(PackHeader) || header.magic != c_packMagic || header.version < 1 || header.version > c_packVersion ||
+			header.indexOffset > pack.size || header.indexSlotCount > (pack.size - header.indexOffset) / GetIndexEntrySize(header.version) ||
+			header.indexSlotCount == 0 || (header.indexSlotCount & (header.indexSlotCount - 1)) != 0 || header.entryCount >= header.indexSlotCount)
+		{
+			printf("Warning: CAS pack file %s is invalid, ignoring it\n", path.c_str());
+			UnmapFile(pack.data, pack.size);
+			continue;
+		}
+
+		m_packs.push_back(pack);
+		loadedAny = true;
+	}
+
+	std::sort(m_packs.begin(), m_packs.end(),
+		[](const Pack& A, const Pack& B)
+		{
+			return A.number > B.number;
+		}
+	);
+
+	return loadedAny;
+}
+
+bool CAS::RescanPacks()
+{
+	// only one thread rescans per interval
+	int64_t now = GetMilliseconds();
+	if (m_packsChanged.exchange(false))
+	{
+		m_lastPackScan = now;
+	}
+	else
+	{
+		int64_t lastScan = m_lastPackScan;
+		if (now - lastScan < c_packRescanMilliseconds || !m_lastPackScan.compare_exchange_strong(lastScan, now))
+			return false;
+	}
+
+	return LoadPacks();
+}
+
+// Data used to be written to disk as a file per key. Put those into a pack file and delete them.
+void CAS::MigrateLooseFiles()
+{
+	std::vector<std::string> fileNames = ListFiles("build/CAS", ".dat");
+	if (fileNames.empty())
+		return;
+
+	printf("Moving %zu CAS files into a pack file\n", fileNames.size());
+
+	std::vector<std::vector<unsigned char>> datas(fileNames.size());
+	std::vector<PackWriteEntry> entries;
+	for (size_t index = 0; index < fileNames.size(); ++index)
+	{
+		std::string path = "build/CAS/" + fileNames[index];
+		FILE* file = nullptr;
+		fopen_s(&file, path.c_str(), "rb");
+		if (!file)
+			continue;
+
+		fseek(file, 0, SEEK_END);
+		datas[index].resize(ftell(file));
+		fseek(file, 0, SEEK_SET);
+		size_t readCount = datas[index].empty() ? 1 : fread(datas[index].data(), datas[index].size(), 1, file);
+		fclose(file);
+		if (readCount != 1)
+			continue;
+
+		entries.push_back({ (size_t)strtoull(fileNames[index].c_str(), nullptr, 10), datas[index].data(), datas[index].size(), datas[index].size(), false, KeyClass::Other });
+		Accessed(entries.back().key);
+	}
+
+	if (!WritePack(entries))
+	{
+		printf("Warning: Could not write CAS pack file, leaving the CAS files alone\n");
+		return;
+	}
+
+	for (const std::string& fileName : fileNames)
+		remove(("build/CAS/" + fileName).c_str());
+}
+
+bool CAS::WritePack(const std::vector<PackWriteEntry>& entries)
+{
+	if (entries.empty())
+		return true;
+
+	_mkdir("build");
+	_mkdir("build/CAS");
+
+	// write to a temporary file and publish it when done, so a partially written pack is never read
+	std::string tempFileName = MakeTempFileName();
+	FILE* file = nullptr;
+	fopen_s(&file, tempFileName.c_str(), "wb");
+	if (!file)
+		return false;
+
+	PackHeader header;
+	header.magic = c_packMagic;
+	header.version = c_packVersion;
+	header.entryCount = entries.size();
+	header.indexSlotCount = 2;
+	while (header.indexSlotCount < entries.size() * 2)
+		header.indexSlotCount *= 2;
+
+	std::vector<PackIndexEntry> index(header.indexSlotCount, PackIndexEntry{ 0, 0, 0, 0 });
+
+	// write the data, filling out the index as we go
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+	uint64_t offset = sizeof(header);
+	static const unsigned char c_padding[c_packAlignment] = {};
+	std::vector<unsigned char> compressed;
+	uint64_t bytesWritten[(int)KeyClass::Count] = {};
+	for (const PackWriteEntry& entry : entries)
+	{
+		size_t padding = (c_packAlignment - offset % c_packAlignment) % c_packAlignment;
+		if (padding > 0)
+			success &= fwrite(c_padding, padding, 1, file) == 1;
+		offset += padding;
+
+		// compress it if asked to, and it makes it smaller
+		const void* data = entry.data;
+		size_t size = entry.size;
+		if (entry.compress && entry.rawSize == entry.size && entry.size > 0)
+		{
+			compressed.resize(LZ4CompressBound(entry.size));
+			size_t compressedSize = LZ4Compress(entry.data, entry.size, compressed.data(), compressed.size());
+			if (compressedSize > 0 && compressedSize < entry.size)
+			{
+				data = compressed.data();
+				size = compressedSize;
+			}
+		}
+
+		if (size > 0)
+			success &= fwrite(data, size, 1, file) == 1;
+
+		size_t slot = entry.key & (header.indexSlotCount - 1);
+		while (index[slot].offset != 0)
+			slot = (slot + 1) & (header.indexSlotCount - 1);
+		index[slot] = { entry.key, offset, size, entry.rawSize };
+
+		bytesWritten[(int)entry.keyClass] += size;
+		offset += size;
+	}
+
+	// write the index, and then the header again, now that we know where the index is
+	header.indexOffset = offset;
+	success &= fwrite(index.data(), index.size() * sizeof(index[0]), 1, file) == 1;
+	success &= fseek(file, 0, SEEK_SET) == 0;
+	success &= fwrite(&header, sizeof(header), 1, file) == 1;
+	success &= fclose(file) == 0;
+
+	if (!success)
+	{
+		remove(tempFileName.c_str());
+		return false;
+	}
+
+	for (int keyClass = 0; keyClass < (int)KeyClass::Count; ++keyClass)
+		m_stats[keyClass].bytesWritten += bytesWritten[keyClass];
+
+	// Publish it as the next pack number. If another process published that number first, try the next one.
+	char fileName[1024];
+	unsigned int number = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::shared_timed_mutex> lock(m_packsLock);
+			number = m_nextPackNumber++;
+		}
+
+		GetPackFileName(fileName, sizeof(fileName), number);
+		if (PublishFile(tempFileName.c_str(), fileName))
+			break;
+
+		if (GetFileAge(fileName) < 0.0)
+		{
+			remove(tempFileName.c_str());
+			return false;
+		}
+	}
+
+	// map the new pack so it can be read from
+	Pack pack;
+	pack.number = number;
+	if (MapFile(fileName, pack.data, pack.size))
+	{
+		std::unique_lock<std::shared_timed_mutex> lock(m_packsLock);
+		m_seenPackNumbers.insert(number);
+		m_packs.push_back(pack);
+		std::sort(m_packs.begin(), m_packs.end(),
+			[](const Pack& A, const Pack& B)
+			{
+				return A.number > B.number;
+			}
+		);
+	}
+
+	return true;
+}
 
 void CAS::FlushToDisk()
 {
+	std::vector<size_t> keys;
+	{
+		std::lock_guard<std::mutex> lock(m_writeLock);
+		keys.swap(m_writePending);
+		m_flushesInProgress++;
+	}
+
+	// a key is in the list again if it was set again
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+	// gather up the data that still needs to be written, holding onto it so it isn't freed while it's written
+	std::vector<PackWriteEntry> entries;
+	std::vector<std::shared_ptr<const unsigned char>> entryDatas;
+	for (size_t key : keys)
+	{
+		Shard& shard = GetShard(key);
+		std::shared_lock<std::shared_timed_mutex> lock(shard.lock);
+		auto it = shard.storage.find(key);
+		if (it != shard.storage.end() && !it->second.transient && !it->second.loading && !it->second.onDisk)
+		{
+			entries.push_back({ key, it->second.data.get(), it->second.size, it->second.size, it->second.compress, it->second.keyClass });
+			entryDatas.push_back(it->second.data);
+		}
+	}
+
+	if (!WritePack(entries))
+	{
+		// try again next time
+		printf("Warning: Could not write CAS pack file\n");
+		{
+			std::lock_guard<std::mutex> lock(m_writeLock);
+			m_writePending.insert(m_writePending.end(), keys.begin(), keys.end());
+		}
+		FlushFinished();
+		return;
+	}
+
+	for (const PackWriteEntry& entry : entries)
+	{
+		Shard& shard = GetShard(entry.key);
+		std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+		auto it = shard.storage.find(entry.key);
+		if (it != shard.storage.end() && it->second.data.get() == entry.data)
+			it->second.onDisk = true;
+	}
+
+	// the data that was just written can be evicted now
+	m_evictRetryAt = 0;
+	FlushFinished();
+}
+
+void CAS::FlushFinished()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_flushLock);
+		m_flushesInProgress--;
+	}
+	m_flushed.notify_all();
+}
+
+void CAS::WriterThread()
+{
+	std::unique_lock<std::mutex> lock(m_writeLock);
+	while (!m_writerStop)
+	{
+		if (m_writePending.empty())
+		{
+			m_writeAdded.wait(lock);
+			continue;
+		}
+
+		// give more data a chance to be set, so it all goes into the same pack file
+		m_writeAdded.wait_for(lock, std::chrono::seconds(c_writeDelaySeconds), [this]() { return m_writerStop; });
+
+		lock.unlock();
+		FlushToDisk();
+		lock.lock();
+	}
+}
+
+static void ReadAccessTimes(std::unordered_map<size_t, uint64_t>& accessTimes)
+{
+	FILE* file = nullptr;
+	fopen_s(&file, c_accessTimesFileName, "rb");
+	if (!file)
+		return;
+
+	// the file is pairs of key and time
+	uint64_t keyTime[2];
+	while (fread(keyTime, sizeof(keyTime), 1, file) == 1)
+		accessTimes[(size_t)keyTime[0]] = keyTime[1];
+	fclose(file);
+}
+
+// When merging, the times in the file are kept unless this process has newer times, so that processes sharing the CAS
+// don't lose each other's times.
+void CAS::WriteAccessTimes(bool merge)
+{
+	std::unordered_map<size_t, uint64_t> accessTimes;
+	if (merge)
+		ReadAccessTimes(accessTimes);
+
+	{
+		std::lock_guard<std::mutex> lock(m_accessLock);
+		for (const auto& pair : m_accessTimes)
+		{
+			uint64_t& accessTime = accessTimes[pair.first];
+			accessTime = std::max(accessTime, pair.second);
+		}
+	}
+
+	if (accessTimes.empty())
+		return;
+
+	_mkdir("build");
+	_mkdir("build/CAS");
+
+	std::string tempFileName = MakeTempFileName();
+	FILE* file = nullptr;
+	fopen_s(&file, tempFileName.c_str(), "wb");
+	if (!file)
+		return;
+
+	bool success = true;
+	for (const auto& pair : accessTimes)
+	{
+		uint64_t keyTime[2] = { pair.first, pair.second };
+		success &= fwrite(keyTime, sizeof(keyTime), 1, file) == 1;
+	}
+	success &= fclose(file) == 0;
+
+	if (!success || !ReplaceWithFile(tempFileName.c_str(), c_accessTimesFileName))
+		remove(tempFileName.c_str());
+}
+
+void CAS::Accessed(size_t key)
+{
+	std::lock_guard<std::mutex> lock(m_accessLock);
+	m_accessTimes[key] = m_startTime;
+}
+
+void CAS::Record(size_t key)
+{
+	std::lock_guard<std::mutex> lock(m_recordLock);
+	m_recordedKeys.insert(key);
+}
+
+bool CAS::LockForMaking(size_t key, MakeLock& makeLock, bool wait)
+{
+	_mkdir("build");
 	_mkdir("build/CAS");
+
 	char fileName[1024];
+	GetLockFileName(fileName, sizeof(fileName), key);
+	std::string pid = std::to_string(GetPID());
 
-	for (auto& pair : m_storage)
+	while (!CreateFileExclusive(fileName, pid))
 	{
-		if (pair.second.transient)
+		// if whatever was making it died, take over the lock
+		if (IsLockStale(fileName))
+		{
+			remove(fileName);
 			continue;
+		}
 
-		sprintf_s(fileName, "build/CAS/%zu.dat", pair.first);
-		FILE* file = nullptr;
-		fopen_s(&file, fileName, "wb");
-		if (file)
+		if (!wait)
 		{
-			fwrite(pair.second.data, pair.second.size, 1, file);
-			fclose(file);
+			CancelMiss(key);
+			return false;
 		}
+
+		// wait for it to be done. The data is in a new pack file now, so look for it on the next miss.
+		while (GetFileAge(fileName) >= 0.0 && !IsLockStale(fileName))
+			std::this_thread::sleep_for(std::chrono::milliseconds(c_makeLockPollMilliseconds));
+		m_packsChanged = true;
+		return false;
 	}
+
+	makeLock.m_keys.push_back(key);
+	return true;
+}
+
+void CAS::UnlockForMaking(const std::vector<size_t>& keys)
+{
+	if (keys.empty())
+		return;
+
+	// The data has to be on disk before other processes stop waiting for it.
+	// Only write it here if it's still pending. If the background writer already took it, wait for that instead.
+	bool pending = false;
+	{
+		std::lock_guard<std::mutex> lock(m_writeLock);
+		for (size_t key : keys)
+			pending |= std::find(m_writePending.begin(), m_writePending.end(), key) != m_writePending.end();
+	}
+	if (pending)
+		FlushToDisk();
+
+	{
+		std::unique_lock<std::mutex> lock(m_flushLock);
+		m_flushed.wait(lock,
+			[this, &keys]()
+			{
+				if (m_flushesInProgress == 0)
+					return true;
+				for (size_t key : keys)
+				{
+					if (!IsOnDisk(key))
+						return false;
+				}
+				return true;
+			}
+		);
+	}
+
+	// if making the data failed, it was never set
+	char fileName[1024];
+	for (size_t key : keys)
+	{
+		GetLockFileName(fileName, sizeof(fileName), key);
+		remove(fileName);
+		CancelMiss(key);
+	}
+}
+
+// Data that isn't in memory anymore was either on disk or transient, so it doesn't need to be written
+bool CAS::IsOnDisk(size_t key)
+{
+	Shard& shard = GetShard(key);
+	std::shared_lock<std::shared_timed_mutex> lock(shard.lock);
+	auto it = shard.storage.find(key);
+	return it == shard.storage.end() || it->second.transient || it->second.onDisk;
+}
+
+void CAS::StartRecording()
+{
+	std::lock_guard<std::mutex> lock(m_recordLock);
+	m_recordedKeys.clear();
+	m_recording = true;
+}
+
+std::unordered_set<size_t> CAS::StopRecording()
+{
+	std::lock_guard<std::mutex> lock(m_recordLock);
+	m_recording = false;
+	std::unordered_set<size_t> ret;
+	ret.swap(m_recordedKeys);
+	return ret;
+}
+
+bool CAS::CollectGarbage(size_t diskQuota, const std::unordered_set<size_t>* keepKeys)
+{
+	// make sure everything is in a pack file first
+	FlushToDisk();
+
+	std::vector<Pack> oldPacks;
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(m_packsLock);
+		oldPacks = m_packs;
+	}
+
+	// find the newest data for each key in the packs
+	struct LiveEntry
+	{
+		size_t key;
+		const void* data;
+		size_t size;
+		size_t rawSize;
+		uint64_t accessTime;
+	};
+
+	std::vector<LiveEntry> entries;
+	size_t totalSize = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_accessLock);
+		std::unordered_set<size_t> seen;
+		for (const Pack& pack : oldPacks)
+		{
+			const PackHeader& header = *(const PackHeader*)pack.data;
+			for (uint64_t slot = 0; slot < header.indexSlotCount; ++slot)
+			{
+				PackIndexEntry entry = GetIndexEntry(pack.data, header, slot);
+				if (entry.offset == 0 || entry.offset + entry.size > header.indexOffset || !seen.insert((size_t)entry.key).second)
+					continue;
+
+				auto it = m_accessTimes.find((size_t)entry.key);
+				entries.push_back({ (size_t)entry.key, &pack.data[entry.offset], (size_t)entry.size, (size_t)entry.rawSize, (it != m_accessTimes.end()) ? it->second : 0 });
+				totalSize += (size_t)entry.size;
+			}
+		}
+	}
+	size_t totalCount = entries.size();
+
+	// only keep what is asked for
+	if (keepKeys)
+	{
+		entries.erase(std::remove_if(entries.begin(), entries.end(),
+			[keepKeys](const LiveEntry& entry)
+			{
+				return keepKeys->count(entry.key) == 0;
+			}
+		), entries.end());
+	}
+
+	// keep the most recently used data that fits in the quota
+	size_t keptSize = 0;
+	if (diskQuota > 0)
+	{
+		std::stable_sort(entries.begin(), entries.end(),
+			[](const LiveEntry& A, const LiveEntry& B)
+			{
+				return A.accessTime > B.accessTime;
+			}
+		);
+
+		size_t keptCount = 0;
+		while (keptCount < entries.size() && keptSize + entries[keptCount].size <= diskQuota)
+			keptSize += entries[keptCount++].size;
+		entries.resize(keptCount);
+	}
+	else
+	{
+		for (const LiveEntry& entry : entries)
+			keptSize += entry.size;
+	}
+
+	printf("CAS garbage collection: keeping %zu of %zu entries, %0.1f of %0.1f MB\n", entries.size(), totalCount, double(keptSize) / (1024.0 * 1024.0), double(totalSize) / (1024.0 * 1024.0));
+
+	// nothing to delete, and the data is already in a single pack
+	if (entries.size() == totalCount && oldPacks.size() <= 1)
+		return true;
+
+	// write what is kept into a new pack, compressed data staying compressed
+	std::vector<PackWriteEntry> writeEntries;
+	for (const LiveEntry& entry : entries)
+		writeEntries.push_back({ entry.key, entry.data, entry.size, entry.rawSize, false, KeyClass::Other });
+
+	if (!WritePack(writeEntries))
+	{
+		printf("Warning: Could not write CAS pack file, nothing was deleted\n");
+		return false;
+	}
+
+	// Forget the data in memory, since it may point into the old packs. Everything was flushed to disk, so nothing is lost.
+	for (Shard& shard : m_shards)
+	{
+		std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+		shard.storage.clear();
+	}
+	m_memoryUsed = 0;
+	for (KeyClassStats& stats : m_stats)
+		stats.bytesResident = 0;
+
+	// unmap and delete the old packs
+	{
+		std::unique_lock<std::shared_timed_mutex> lock(m_packsLock);
+		for (const Pack& oldPack : oldPacks)
+		{
+			m_packs.erase(std::remove_if(m_packs.begin(), m_packs.end(),
+				[&oldPack](const Pack& pack)
+				{
+					return pack.number == oldPack.number;
+				}
+			), m_packs.end());
+			UnmapFile(oldPack.data, oldPack.size);
+
+			char fileName[1024];
+			GetPackFileName(fileName, sizeof(fileName), oldPack.number);
+			if (remove(fileName) != 0)
+				printf("Warning: Could not delete CAS pack file %s\n", fileName);
+		}
+	}
+
+	// delete temporary files left behind by processes that died while writing them
+	for (const std::string& fileName : ListFiles("build/CAS", ".tmp"))
+	{
+		int pid = atoi(fileName.c_str());
+		if (pid != GetPID() && !IsProcessRunning(pid))
+			remove(("build/CAS/" + fileName).c_str());
+	}
+
+	// forget the access times of deleted data
+	{
+		std::unordered_set<size_t> keptKeys;
+		for (const LiveEntry& entry : entries)
+			keptKeys.insert(entry.key);
+
+		std::lock_guard<std::mutex> lock(m_accessLock);
+		for (auto it = m_accessTimes.begin(); it != m_accessTimes.end();)
+		{
+			if (keptKeys.count(it->first) == 0)
+				it = m_accessTimes.erase(it);
+			else
+				++it;
+		}
+	}
+	WriteAccessTimes(false);
+
+	return true;
 }
 
 CAS::CAS()
 {
-	omp_init_lock(&m_lock);
+	m_startTime = (uint64_t)time(nullptr);
+	ReadAccessTimes(m_accessTimes);
+	LoadPacks();
+	m_lastPackScan = GetMilliseconds();
+	MigrateLooseFiles();
+	m_writer = std::thread(&CAS::WriterThread, this);
 }
 
 CAS::~CAS()
 {
+	// stop the background writer, then write whatever it didn't get to
+	{
+		std::lock_guard<std::mutex> lock(m_writeLock);
+		m_writerStop = true;
+	}
+	m_writeAdded.notify_one();
+	m_writer.join();
+
 	FlushToDisk();
+	WriteAccessTimes(true);
 
-	for (auto& pair : m_storage)
-		delete[] pair.second.data;
+	// free the data before the pack files it may point into are unmapped
+	for (Shard& shard : m_shards)
+		shard.storage.clear();
 
-	m_storage.clear();
+	for (const Pack& pack : m_packs)
+		UnmapFile(pack.data, pack.size);
+	m_packs.clear();
+}
 
-	for (void* ptr : m_orphanedMemory)
-		delete[] ptr;
-	m_orphanedMemory.clear();
+bool CAS::LoadFromDisk(size_t key, KeyClass keyClass, std::shared_ptr<const unsigned char>& data, size_t& size, bool& mapped)
+{
+	const unsigned char* packData = nullptr;
+	size_t packSize = 0;
+	if (!FindInPacks(key, packData, packSize, size))
+	{
+		// another process may have written it since the packs were last loaded
+		if (!RescanPacks() || !FindInPacks(key, packData, packSize, size))
+			return false;
+	}
+	m_stats[(int)keyClass].bytesRead += packSize;
+
+	// the pack file stays mapped until shutdown, so there is nothing to free
+	if (packSize == size)
+	{
+		data = std::shared_ptr<const unsigned char>(packData, [](const unsigned char*) {});
+		mapped = true;
+		return true;
+	}
 
-	omp_destroy_lock(&m_lock);
+	// decompress it into memory once, so it's ready to use every time it's gotten
+	unsigned char* newData = new unsigned char[size];
+	if (!LZ4Decompress(packData, packSize, newData, size))
+	{
+		printf("Warning: CAS data for key %zu is corrupt\n", key);
+		delete[] newData;
+		return false;
+	}
+
+	data = std::shared_ptr<const unsigned char>(newData, std::default_delete<unsigned char[]>());
+	mapped = false;
+	return true;
+}
+
+bool CAS::FindInPacks(size_t key, const unsigned char*& data, size_t& size, size_t& rawSize)
+{
+	std::shared_lock<std::shared_timed_mutex> lock(m_packsLock);
+	for (const Pack& pack : m_packs)
+	{
+		const PackHeader& header = *(const PackHeader*)pack.data;
+
+		// the entry count in the header can't be trusted to leave an empty slot, so don't probe more than every slot
+		size_t slot = key & (header.indexSlotCount - 1);
+		for (uint64_t probe = 0; probe < header.indexSlotCount; ++probe)
+		{
+			PackIndexEntry entry = GetIndexEntry(pack.data, header, slot);
+			if (entry.offset == 0)
+				break;
+
+			if (entry.key == key)
+			{
+				if (entry.offset + entry.size > header.indexOffset)
+					break;
+
+				data = &pack.data[entry.offset];
+				size = (size_t)entry.size;
+				rawSize = (size_t)entry.rawSize;
+				return true;
+			}
+			slot = (slot + 1) & (header.indexSlotCount - 1);
+		}
+	}
+	return false;
+}
+
+void CAS::SetMemoryBudget(size_t bytes)
+{
+	m_memoryBudget = bytes;
+	m_evictRetryAt = 0;
+	Evict();
+}
+
+void CAS::Evict()
+{
+	size_t budget = m_memoryBudget;
+	if (budget == 0 || m_memoryUsed <= budget || m_memoryUsed < m_evictRetryAt)
+		return;
+
+	// only one thread needs to do this at a time
+	std::unique_lock<std::mutex> evictLock(m_evictLock, std::try_to_lock);
+	if (!evictLock.owns_lock())
+		return;
+
+	// Data can be freed if nobody is holding a handle to it, and it can be made again or loaded again from disk.
+	// Data that isn't on disk yet is kept until the background writer writes it.
+	auto CanEvict = [](const Storage& storage)
+	{
+		return !storage.loading && !storage.mapped && (storage.transient || storage.onDisk) && storage.data.use_count() == 1;
+	};
+
+	struct Candidate
+	{
+		uint64_t lastUse;
+		size_t key;
+	};
+
+	std::vector<Candidate> candidates;
+	for (Shard& shard : m_shards)
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(shard.lock);
+		for (auto& pair : shard.storage)
+		{
+			if (CanEvict(pair.second))
+				candidates.push_back({ pair.second.lastUse.load(std::memory_order_relaxed), pair.first });
+		}
+	}
+
+	std::sort(candidates.begin(), candidates.end(),
+		[](const Candidate& A, const Candidate& B)
+		{
+			return A.lastUse < B.lastUse;
+		}
+	);
+
+	// free the least recently used data until comfortably under budget, so this doesn't happen again on the next set
+	size_t target = budget - budget / 8;
+	for (const Candidate& candidate : candidates)
+	{
+		if (m_memoryUsed <= target)
+			break;
+
+		Shard& shard = GetShard(candidate.key);
+		std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+		auto it = shard.storage.find(candidate.key);
+		if (it == shard.storage.end() || !CanEvict(it->second))
+			continue;
+
+		m_memoryUsed -= it->second.size;
+		m_stats[(int)it->second.keyClass].bytesResident -= it->second.size;
+		shard.storage.erase(it);
+	}
+
+	// If it's still over budget, everything left is pinned, so don't scan again on every set.
+	// Wait for memory use to grow by a margin, or for the writer to put more data on disk.
+	size_t memoryUsed = m_memoryUsed;
+	m_evictRetryAt = (memoryUsed > budget) ? memoryUsed + budget / 16 : 0;
 }
 
-void* CAS::Get(size_t key, size_t* _size)
+CAS::Handle CAS::Get(size_t key, KeyClass keyClass)
 {
-	omp_set_lock(&m_lock);
+	if (m_recording)
+		Record(key);
+
+	Shard& shard = GetShard(key);
+	Handle ret;
 
 	// if it's already in memory, return it
-	auto it = m_storage.find(key);
-	if (it != m_storage.end())
 	{
-		void* ret = it->second.data;
-		if (_size)
-			*_size = it->second.size;
-		omp_unset_lock(&m_lock);
-		return ret;
+		std::shared_lock<std::shared_timed_mutex> lock(shard.lock);
+		while (true)
+		{
+			auto it = shard.storage.find(key);
+			if (it == shard.storage.end())
+				break;
+
+			if (!it->second.loading)
+			{
+				it->second.lastUse.store(++m_useCount, std::memory_order_relaxed);
+				m_stats[(int)keyClass].memoryHits++;
+				ret.m_data = it->second.data;
+				ret.m_size = it->second.size;
+				return ret;
+			}
+
+			// another thread is loading it from disk, so wait for that
+			shard.loaded.wait(lock);
+		}
 	}
 
-	// else try and load it from disk
-	char fileName[1024];
-	sprintf_s(fileName, "build/CAS/%zu.dat", key);
-	FILE* file = nullptr;
-	fopen_s(&file, fileName, "rb");
-	if (!file)
+	// else claim the key, so this is the only thread that tries to load it from disk
 	{
-		omp_unset_lock(&m_lock);
-		return nullptr;
+		std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+		if (shard.storage.count(key) > 0)
+		{
+			// another thread got to it first
+			lock.unlock();
+			return Get(key, keyClass);
+		}
+		shard.storage[key].loading = true;
 	}
 
-	// if we could open the file, read in the data and return it
-	fseek(file, 0, SEEK_END);
-	size_t size = ftell(file);
-	fseek(file, 0, SEEK_SET);
-	unsigned char* newData = new unsigned char[size];
-	fread(newData, size, 1, file);
-	m_storage[key] = { newData, size };
-	fclose(file);
+	// find it in the pack files without holding the lock, so other threads can keep using this shard.
+	// Uncompressed data is used right out of the memory mapped pack file, not copied.
+	std::shared_ptr<const unsigned char> data;
+	size_t size = 0;
+	bool mapped = false;
+	bool loaded = LoadFromDisk(key, keyClass, data, size, mapped);
+
+	{
+		std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+		if (loaded)
+		{
+			Storage& storage = shard.storage[key];
+			storage.data = data;
+			storage.size = size;
+			storage.keyClass = keyClass;
+			storage.loading = false;
+			storage.onDisk = true;
+			storage.mapped = mapped;
+			storage.lastUse.store(++m_useCount, std::memory_order_relaxed);
+			if (!mapped)
+			{
+				m_memoryUsed += size;
+				m_stats[(int)keyClass].bytesResident += size;
+			}
+			m_stats[(int)keyClass].diskHits++;
+
+			ret.m_data = storage.data;
+			ret.m_size = size;
+		}
+		else
+		{
+			// remember when it was missed, to know how long it took to make when it's set
+			shard.storage.erase(key);
+			if (shard.missTimes.size() >= c_maxMissTimesPerShard)
+				shard.missTimes.clear();
+			shard.missTimes[key] = std::chrono::steady_clock::now();
+			m_stats[(int)keyClass].misses++;
+		}
+	}
+	shard.loaded.notify_all();
 
-	if (_size)
-		*_size = size;
+	if (loaded)
+	{
+		Accessed(key);
+		if (!mapped)
+			Evict();
+	}
 
-	omp_unset_lock(&m_lock);
-	return newData;
+	return ret;
 }
 
-void CAS::Set(size_t key, const void* data, size_t size, bool transient)
+CAS::Handle CAS::Set(size_t key, KeyClass keyClass, const void* data, size_t size, bool transient, bool compress)
 {
-	omp_set_lock(&m_lock);
+	if (m_recording)
+		Record(key);
 
-	// if the same data is already there, ignore this
-	CAS::Storage existing;
-	auto it = m_storage.find(key);
-	if (it != m_storage.end())
-		existing = it->second;
+	if (!transient)
+		Accessed(key);
 
-	if (existing.data && existing.size == size && memcmp(existing.data, data, size) == 0)
+	Shard& shard = GetShard(key);
+	Handle ret;
 	{
-		omp_unset_lock(&m_lock);
-		return;
+		std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+
+		auto missTime = shard.missTimes.find(key);
+		if (missTime != shard.missTimes.end())
+		{
+			m_stats[(int)keyClass].produceMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - missTime->second).count();
+			shard.missTimes.erase(missTime);
+		}
+
+		// if a thread is loading this key from disk, wait for it to finish
+		auto it = shard.storage.find(key);
+		while (it != shard.storage.end() && it->second.loading)
+		{
+			shard.loaded.wait(lock);
+			it = shard.storage.find(key);
+		}
+
+		if (it != shard.storage.end())
+		{
+			Storage& existing = it->second;
+
+			// if the same data is already there, ignore this
+			if (existing.size == size && memcmp(existing.data.get(), data, size) == 0)
+			{
+				existing.lastUse.store(++m_useCount, std::memory_order_relaxed);
+				ret.m_data = existing.data;
+				ret.m_size = existing.size;
+				return ret;
+			}
+
+			// anyone holding a handle to the old data keeps it alive until they are done with it
+			printf("Warning: CAS::Set() got an existing key but with new data. CAS may be stale and need to be deleted?\n");
+			if (!existing.mapped)
+			{
+				m_memoryUsed -= existing.size;
+				m_stats[(int)existing.keyClass].bytesResident -= existing.size;
+			}
+		}
+
+		unsigned char* newData = new unsigned char[size];
+		memcpy(newData, data, size);
+
+		Storage& storage = shard.storage[key];
+		storage.data = std::shared_ptr<const unsigned char>(newData, std::default_delete<unsigned char[]>());
+		storage.size = size;
+		storage.keyClass = keyClass;
+		storage.transient = transient;
+		storage.compress = compress;
+		storage.loading = false;
+		storage.onDisk = false;
+		storage.mapped = false;
+		storage.lastUse.store(++m_useCount, std::memory_order_relaxed);
+		m_memoryUsed += size;
+		m_stats[(int)keyClass].bytesResident += size;
+
+		ret.m_data = storage.data;
+		ret.m_size = size;
+
+		// let the background writer know there is new data to write
+		if (!transient)
+		{
+			std::lock_guard<std::mutex> writeLock(m_writeLock);
+			m_writePending.push_back(key);
+			if (m_writePending.size() == 1)
+				m_writeAdded.notify_one();
+		}
 	}
 
-	// nobody should be using this memory, but in case they are, stash it off to be destroyed on shutdown, instead of right now
-	if (existing.data)
+	Evict();
+	return ret;
+}
+
+void CAS::CancelMiss(size_t key)
+{
+	Shard& shard = GetShard(key);
+	std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+	shard.missTimes.erase(key);
+}
+
+const char* CAS::GetKeyClassName(KeyClass keyClass)
+{
+	switch (keyClass)
 	{
-		printf("Warning: CAS::Set() got an existing key but with new data. CAS may be stale and need to be deleted?\n");
-		m_orphanedMemory.push_back(existing.data);
+		case KeyClass::Other: return "Other";
+		case KeyClass::Latex: return "Latex";
+		case KeyClass::ImageSource: return "ImageSource";
+		case KeyClass::Image: return "Image";
+		case KeyClass::DigitalDissolve: return "DigitalDissolve";
+		case KeyClass::VideoFrameCount: return "VideoFrameCount";
+		case KeyClass::CubicBezier: return "CubicBezier";
+		case KeyClass::JitterSequence: return "JitterSequence";
 	}
+	return "Unknown";
+}
 
-	unsigned char* newData = new unsigned char[size];
-	memcpy(newData, data, size);
-	m_storage[key] = { newData, size, transient };
+CAS::Stats CAS::GetStats(KeyClass keyClass) const
+{
+	const KeyClassStats& stats = m_stats[(int)keyClass];
+	Stats ret;
+	ret.memoryHits = stats.memoryHits;
+	ret.diskHits = stats.diskHits;
+	ret.misses = stats.misses;
+	ret.bytesResident = stats.bytesResident;
+	ret.bytesRead = stats.bytesRead;
+	ret.bytesWritten = stats.bytesWritten;
+	ret.produceSeconds = double(stats.produceMicroseconds) / 1000000.0;
+	return ret;
+}
+
+void CAS::ReportStats() const
+{
+	printf("CAS:\n  %-16s %12s %12s %12s %12s %12s %12s %12s\n", "", "memory hits", "disk hits", "misses", "resident MB", "read MB", "written MB", "produce sec");
+	for (int keyClass = 0; keyClass < (int)KeyClass::Count; ++keyClass)
+	{
+		Stats stats = GetStats((KeyClass)keyClass);
+		if (stats.memoryHits == 0 && stats.diskHits == 0 && stats.misses == 0 && stats.bytesWritten == 0)
+			continue;
+
+		printf("  %-16s %12llu %12llu %12llu %12.1f %12.1f %12.1f %12.3f\n", GetKeyClassName((KeyClass)keyClass),
+			(unsigned long long)stats.memoryHits, (unsigned long long)stats.diskHits, (unsigned long long)stats.misses,
+			double(stats.bytesResident) / (1024.0 * 1024.0), double(stats.bytesRead) / (1024.0 * 1024.0), double(stats.bytesWritten) / (1024.0 * 1024.0),
+			stats.produceSeconds);
+	}
+}
+
+bool CAS::WriteStats(const char* fileName) const
+{
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n");
+	for (int keyClass = 0; keyClass < (int)KeyClass::Count; ++keyClass)
+	{
+		Stats stats = GetStats((KeyClass)keyClass);
+		fprintf(file, "  \"%s\": {\n", GetKeyClassName((KeyClass)keyClass));
+		fprintf(file, "    \"memoryHits\": %llu,\n", (unsigned long long)stats.memoryHits);
+		fprintf(file, "    \"diskHits\": %llu,\n", (unsigned long long)stats.diskHits);
+		fprintf(file, "    \"misses\": %llu,\n", (unsigned long long)stats.misses);
+		fprintf(file, "    \"bytesResident\": %llu,\n", (unsigned long long)stats.bytesResident);
+		fprintf(file, "    \"bytesRead\": %llu,\n", (unsigned long long)stats.bytesRead);
+		fprintf(file, "    \"bytesWritten\": %llu,\n", (unsigned long long)stats.bytesWritten);
+		fprintf(file, "    \"produceSeconds\": %f\n", stats.produceSeconds);
+		fprintf(file, "  }%s\n", (keyClass + 1 < (int)KeyClass::Count) ? "," : "");
+	}
+	fprintf(file, "}\n");
 
-	omp_unset_lock(&m_lock);
+	return fclose(file) == 0;
 }
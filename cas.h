@@ -3,8 +3,16 @@
 #pragma once
 
 #include <unordered_map>
-#include <omp.h>
+#include <unordered_set>
+#include <shared_mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <stdint.h>
 
 class CAS
 {
@@ -13,29 +21,126 @@ public:
 	CAS();
 	~CAS();
 
+	// Data in the CAS is read only. Holding a handle keeps the data in memory, so it isn't freed by the memory budget.
+	class Handle
+	{
+	public:
+		const void* Data() const { return m_data.get(); }
+		size_t Size() const { return m_size; }
+
+		template <typename T>
+		const T* As() const { return (const T*)m_data.get(); }
+
+		explicit operator bool() const { return m_data != nullptr; }
+
+	private:
+		friend class CAS;
+		std::shared_ptr<const unsigned char> m_data;
+		size_t m_size = 0;
+	};
+
+	// Statistics are kept for each class of data, to see where time is spent and whether the cache is working
+	enum class KeyClass
+	{
+		Other,
+		Latex,
+		ImageSource,
+		Image,
+		DigitalDissolve,
+		VideoFrameCount,
+		CubicBezier,
+		JitterSequence,
+		Count
+	};
+
+	struct Stats
+	{
+		uint64_t memoryHits = 0;
+		uint64_t diskHits = 0;
+		uint64_t misses = 0;
+		uint64_t bytesResident = 0; // memory allocated for the data. Data used straight from a mapped pack file isn't counted.
+		uint64_t bytesRead = 0; // read from pack files
+		uint64_t bytesWritten = 0; // written to pack files, after compression
+		double produceSeconds = 0.0; // the time from a miss until the data was set
+	};
+
 	bool Init()
 	{
-		return Get(0) == nullptr;
+		bool ret = !Get(0, KeyClass::Other);
+		CancelMiss(0);
+		return ret;
 	}
 
-	void* Get(size_t key, size_t* size = nullptr);
-	void Set(size_t key, const void* data, size_t size, bool transient);
+	// The least recently used data is freed when the CAS uses more than this much memory. Data that is freed is
+	// loaded again from disk, or made again if it's transient. 0 means no limit.
+	void SetMemoryBudget(size_t bytes);
+
+	// Transient data is never written to disk. Compressed data is smaller on disk, and is decompressed into memory
+	// when it's loaded, instead of being used straight from the pack file.
+	Handle Get(size_t key, KeyClass keyClass);
+	Handle Set(size_t key, KeyClass keyClass, const void* data, size_t size, bool transient, bool compress = false);
 
 	template <typename T>
-	static void Set(size_t key, const T& data, bool transient)
+	static Handle Set(size_t key, KeyClass keyClass, const T& data, bool transient, bool compress = false)
 	{
-		Get().Set(key, &data, sizeof(data), transient);
+		return Get().Set(key, keyClass, &data, sizeof(data), transient, compress);
 	}
 
 	template <typename T>
-	static void Set(size_t key, const std::vector<T>& data, bool transient)
+	static Handle Set(size_t key, KeyClass keyClass, const std::vector<T>& data, bool transient, bool compress = false)
 	{
-		Get().Set(key, data.data(), data.size() * sizeof(data[0]), transient);
+		return Get().Set(key, keyClass, data.data(), data.size() * sizeof(data[0]), transient, compress);
 	}
 
-	// Happens when destructor is called, but you can call it manually if you want to
+	// Writes data that isn't on disk yet. A background thread does this shortly after data is set, and it happens when
+	// the destructor is called, but you can call it manually if you want to.
 	void FlushToDisk();
 
+	// Several processes can share the CAS. A lock file lets the others know that a process is making the data for a key,
+	// so they can wait for it instead of making it too. When a MakeLock is destroyed, the data that was set is written
+	// to disk and then its lock files are deleted.
+	class MakeLock
+	{
+	public:
+		MakeLock() = default;
+		MakeLock(const MakeLock&) = delete;
+		MakeLock& operator=(const MakeLock&) = delete;
+
+		~MakeLock()
+		{
+			CAS::Get().UnlockForMaking(m_keys);
+		}
+
+	private:
+		friend class CAS;
+		std::vector<size_t> m_keys;
+	};
+
+	// Returns true if the key was locked for making, and the caller should make the data.
+	// Returns false if something else is making it. If wait is true, it first waits for them to finish, and the caller
+	// should Get the key again.
+	bool LockForMaking(size_t key, MakeLock& makeLock, bool wait = true);
+
+	// Deletes data on disk that isn't in keepKeys, if keepKeys isn't null, then deletes the least recently used data
+	// until the rest fits in diskQuota bytes, if diskQuota isn't 0. The data that is kept is written into a single pack.
+	// Nothing can be holding a handle to data in the CAS when this is called.
+	bool CollectGarbage(size_t diskQuota, const std::unordered_set<size_t>* keepKeys);
+
+	// While recording, the keys of all data gotten or set are remembered. Used to find what data documents use.
+	void StartRecording();
+	std::unordered_set<size_t> StopRecording();
+
+	// The time from a miss until the key is set is counted as time spent making the data. Call this when a key that
+	// was missed isn't going to be set, such as when making it failed.
+	void CancelMiss(size_t key);
+
+	static const char* GetKeyClassName(KeyClass keyClass);
+	Stats GetStats(KeyClass keyClass) const;
+
+	// Prints the stats of each class of data that was used, or writes them as JSON
+	void ReportStats() const;
+	bool WriteStats(const char* fileName) const;
+
 	static CAS& Get()
 	{
 		static CAS cas;
@@ -46,13 +151,132 @@ private:
 
 	struct Storage
 	{
-		void* data = nullptr;
+		std::shared_ptr<const unsigned char> data;
 		size_t size = 0;
+		KeyClass keyClass = KeyClass::Other;
 		bool transient = false;
+		bool compress = false;
+		bool loading = false; // a thread is loading this from disk. Other threads wait for it instead of loading it too.
+		bool onDisk = false; // it's in a pack file already, so doesn't need to be written again
+		bool mapped = false; // data points into a memory mapped pack file, instead of memory we allocated
+		std::atomic<uint64_t> lastUse{ 0 };
+	};
+
+	// The storage is split into shards by key, each with it's own lock, so threads using different keys rarely wait
+	// on each other. Finding data that is already in memory only takes a shared lock.
+	struct Shard
+	{
+		std::shared_timed_mutex lock;
+		std::condition_variable_any loaded;
+		std::unordered_map<size_t, Storage> storage;
+		std::unordered_map<size_t, std::chrono::steady_clock::time_point> missTimes; // keys that were missed and not set yet
 	};
 
-	omp_lock_t m_lock;
+	static const size_t c_shardCount = 64;
+
+	Shard& GetShard(size_t key)
+	{
+		// the keys are hashes, but mix in the high bits in case the low bits are poorly distributed
+		return m_shards[(key ^ (key >> 32)) % c_shardCount];
+	}
+
+	// Data written to disk goes into pack files, which are never modified after they are written. Each flush to disk
+	// writes a new pack file. Pack files are memory mapped and data is read directly out of them.
+	struct Pack
+	{
+		unsigned int number = 0;
+		const unsigned char* data = nullptr;
+		size_t size = 0;
+	};
+
+	// If rawSize is different than size, the data is already compressed
+	struct PackWriteEntry
+	{
+		size_t key;
+		const void* data;
+		size_t size;
+		size_t rawSize;
+		bool compress;
+		KeyClass keyClass;
+	};
+
+	bool LoadFromDisk(size_t key, KeyClass keyClass, std::shared_ptr<const unsigned char>& data, size_t& size, bool& mapped);
+	bool FindInPacks(size_t key, const unsigned char*& data, size_t& size, size_t& rawSize);
+
+	// maps pack files that haven't been seen yet, including those written by other processes. Returns true if any were
+	bool LoadPacks();
+
+	// Calls LoadPacks on a miss, but only if it hasn't been done recently, or a make lock held by another process was
+	// waited on since the last time. Listing the directory on every miss would make misses slow.
+	bool RescanPacks();
+	void MigrateLooseFiles();
+	bool WritePack(const std::vector<PackWriteEntry>& entries);
+
+	void WriterThread();
+	void FlushFinished();
+
+	void WriteAccessTimes(bool merge);
+	void Accessed(size_t key);
+	void Record(size_t key);
+	void UnlockForMaking(const std::vector<size_t>& keys);
+	bool IsOnDisk(size_t key);
+
+	// frees the least recently used data if over the memory budget
+	void Evict();
+
+	Shard m_shards[c_shardCount];
+
+	struct KeyClassStats
+	{
+		std::atomic<uint64_t> memoryHits{ 0 };
+		std::atomic<uint64_t> diskHits{ 0 };
+		std::atomic<uint64_t> misses{ 0 };
+		std::atomic<uint64_t> bytesResident{ 0 };
+		std::atomic<uint64_t> bytesRead{ 0 };
+		std::atomic<uint64_t> bytesWritten{ 0 };
+		std::atomic<uint64_t> produceMicroseconds{ 0 };
+	};
+
+	KeyClassStats m_stats[(int)KeyClass::Count];
+
+	// memory used by data that isn't memory mapped
+	std::atomic<size_t> m_memoryBudget{ 0 };
+	std::atomic<size_t> m_memoryUsed{ 0 };
+	std::atomic<uint64_t> m_useCount{ 0 };
+	std::mutex m_evictLock;
+
+	// When eviction can't get under budget, because the data isn't on disk yet or has handles held to it, it isn't
+	// tried again until memory use reaches this, or the writer puts more data on disk. 0 means try on the next call.
+	std::atomic<size_t> m_evictRetryAt{ 0 };
+
+	// the last time data on disk was used, in seconds. Used to decide what to delete when over the disk quota.
+	// The time is updated when data is loaded from disk or set, so it's the last run that used it.
+	std::mutex m_accessLock;
+	std::unordered_map<size_t, uint64_t> m_accessTimes;
+	uint64_t m_startTime = 0;
+
+	std::atomic<bool> m_recording{ false };
+	std::mutex m_recordLock;
+	std::unordered_set<size_t> m_recordedKeys;
+
+	// newest pack first, so newer data for a key is found before older data
+	std::shared_timed_mutex m_packsLock;
+	std::vector<Pack> m_packs;
+	std::unordered_set<unsigned int> m_seenPackNumbers;
+	unsigned int m_nextPackNumber = 0;
+	std::atomic<bool> m_packsChanged{ false };
+	std::atomic<int64_t> m_lastPackScan{ 0 };
+
+	// keys that have been set but not written to disk yet
+	std::mutex m_writeLock;
+	std::condition_variable m_writeAdded;
+	std::vector<size_t> m_writePending;
+	std::thread m_writer;
+	bool m_writerStop = false;
 
-	std::unordered_map<size_t, Storage> m_storage;
-	std::vector<void*> m_orphanedMemory;
-};
\ No newline at end of file
+	// flushes that have taken keys from m_writePending and not finished writing them yet.
+	// m_flushed is notified when one finishes.
+	std::atomic<int> m_flushesInProgress{ 0 };
+	std::mutex m_flushLock;
+	std::condition_variable m_flushed;
+};
@@ -0,0 +1,197 @@
+#include "compression.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+static const size_t c_minMatch = 4;
+static const size_t c_lastLiterals = 5;      // the last 5 bytes are always literals
+static const size_t c_matchFindLimit = 12;   // the last match has to start at least 12 bytes before the end
+static const size_t c_maxOffset = 65535;
+static const int c_hashBits = 16;
+
+static uint32_t Read32(const uint8_t* p)
+{
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+static uint32_t HashSequence(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - c_hashBits);
+}
+
+// A length that doesn't fit in the 4 bits of the token continues as bytes of 255, then a byte less than 255
+static void WriteLength(uint8_t*& op, size_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+}
+
+static bool ReadLength(const uint8_t*& ip, const uint8_t* iend, size_t& length)
+{
+    uint8_t value = 255;
+    while (value == 255)
+    {
+        if (ip >= iend)
+            return false;
+        value = *ip++;
+        length += value;
+    }
+    return true;
+}
+
+// A match length of 0 means this is the last sequence, which is only literals
+static bool WriteSequence(uint8_t*& op, const uint8_t* oend, const uint8_t* literals, size_t literalLength, size_t offset, size_t matchLength)
+{
+    size_t worstCaseSize = 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1;
+    if (size_t(oend - op) < worstCaseSize)
+        return false;
+
+    uint8_t* token = op++;
+    *token = uint8_t((literalLength < 15 ? literalLength : 15) << 4);
+    if (literalLength >= 15)
+        WriteLength(op, literalLength - 15);
+
+    if (literalLength > 0)
+        memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (matchLength == 0)
+        return true;
+
+    *op++ = uint8_t(offset & 255);
+    *op++ = uint8_t(offset >> 8);
+
+    size_t matchCode = matchLength - c_minMatch;
+    *token |= uint8_t(matchCode < 15 ? matchCode : 15);
+    if (matchCode >= 15)
+        WriteLength(op, matchCode - 15);
+
+    return true;
+}
+
+size_t LZ4Compress(const void* _src, size_t srcSize, void* _dest, size_t destCapacity)
+{
+    const uint8_t* src = (const uint8_t*)_src;
+    uint8_t* dest = (uint8_t*)_dest;
+    uint8_t* op = dest;
+    const uint8_t* oend = dest + destCapacity;
+
+    // the position in src where each hashed 4 byte sequence was last seen
+    std::vector<uint32_t> hashTable(size_t(1) << c_hashBits, 0);
+
+    size_t anchor = 0;
+    if (srcSize > c_matchFindLimit)
+    {
+        size_t matchLimit = srcSize - c_lastLiterals;
+        size_t searchLimit = srcSize - c_matchFindLimit;
+        size_t ip = 0;
+        size_t misses = 0;
+        while (ip < searchLimit)
+        {
+            uint32_t sequence = Read32(&src[ip]);
+            uint32_t& entry = hashTable[HashSequence(sequence)];
+            size_t candidate = entry;
+            entry = (uint32_t)ip;
+
+            // skip ahead faster the longer it's been since a match, so data that doesn't compress is fast to get through
+            if (candidate >= ip || ip - candidate > c_maxOffset || Read32(&src[candidate]) != sequence)
+            {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            // grow the match backwards into the literals, and then forwards as far as it goes
+            while (ip > anchor && candidate > 0 && src[ip - 1] == src[candidate - 1])
+            {
+                ip--;
+                candidate--;
+            }
+
+            size_t matchLength = c_minMatch;
+            while (ip + matchLength < matchLimit && src[ip + matchLength] == src[candidate + matchLength])
+                matchLength++;
+
+            if (!WriteSequence(op, oend, &src[anchor], ip - anchor, ip - candidate, matchLength))
+                return 0;
+
+            ip += matchLength;
+            anchor = ip;
+
+            // remember a position inside the match, so the data right after it can match against it
+            if (ip < searchLimit)
+                hashTable[HashSequence(Read32(&src[ip - 2]))] = uint32_t(ip - 2);
+        }
+    }
+
+    if (!WriteSequence(op, oend, &src[anchor], srcSize - anchor, 0, 0))
+        return 0;
+
+    return size_t(op - dest);
+}
+
+bool LZ4Decompress(const void* _src, size_t srcSize, void* _dest, size_t destSize)
+{
+    const uint8_t* ip = (const uint8_t*)_src;
+    const uint8_t* iend = ip + srcSize;
+    uint8_t* dest = (uint8_t*)_dest;
+    uint8_t* op = dest;
+    const uint8_t* oend = dest + destSize;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        // copy the literals
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !ReadLength(ip, iend, literalLength))
+            return false;
+        if (literalLength > size_t(iend - ip) || literalLength > size_t(oend - op))
+            return false;
+
+        if (literalLength > 0)
+            memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        // the last sequence has no match
+        if (ip == iend)
+            break;
+
+        // copy the match
+        if (iend - ip < 2)
+            return false;
+        size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > size_t(op - dest))
+            return false;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !ReadLength(ip, iend, matchLength))
+            return false;
+        matchLength += c_minMatch;
+        if (matchLength > size_t(oend - op))
+            return false;
+
+        // A match can overlap the bytes it is writing, which repeats them. A repeated single byte is a fill.
+        const uint8_t* match = op - offset;
+        if (offset == 1)
+            memset(op, *match, matchLength);
+        else if (offset >= matchLength)
+            memcpy(op, match, matchLength);
+        else
+        {
+            for (size_t index = 0; index < matchLength; ++index)
+                op[index] = match[index];
+        }
+        op += matchLength;
+    }
+
+    return op == oend;
+}
@@ -0,0 +1,19 @@
+// A compressor and decompressor for the LZ4 block format: https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+// It's fast to compress and very fast to decompress, and does well on long runs of repeated bytes, like the empty
+// space around latex.
+
+#pragma once
+
+#include <stddef.h>
+
+// The most bytes that compressing srcSize bytes can take
+inline size_t LZ4CompressBound(size_t srcSize)
+{
+    return srcSize + srcSize / 255 + 16;
+}
+
+// Returns the compressed size, or 0 if it didn't fit in destCapacity bytes
+size_t LZ4Compress(const void* src, size_t srcSize, void* dest, size_t destCapacity);
+
+// Returns false if the data is corrupt, or doesn't decompress to exactly destSize bytes
+bool LZ4Decompress(const void* src, size_t srcSize, void* dest, size_t destSize);
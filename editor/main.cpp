@@ -403,6 +403,11 @@ bool ShouldDelayUpdate(const RootDocumentType& A, const RootDocumentType& B)
                 ret |= eA.data.image.fileName != eB.data.image.fileName;
                 break;
             }
+            case Data::EntityVariant::c_index_flipbook:
+            {
+                ret |= eA.data.flipbook.videoFile != eB.data.flipbook.videoFile;
+                break;
+            }
         }
     }
 
@@ -9,40 +9,53 @@
 #include "schemas/hash.h"
 #include "cas.h"
 #include "animatron.h"
+#include "flipbook.h"
 
-#include <Windows.h>
-
-void Run(const char* program, char* commandLine, const char* currentDirectory, bool waitForFinish = true)
-{
-    // additional information
-    STARTUPINFOA si;
-    PROCESS_INFORMATION pi;
-
-    // set the size of the structures
-    ZeroMemory(&si, sizeof(si));
-    si.cb = sizeof(si);
-    ZeroMemory(&pi, sizeof(pi));
-
-    // start the program up
-    bool ret = CreateProcessA(program,   // the path
-        commandLine,        // Command line
-        NULL,           // Process handle not inheritable
-        NULL,           // Thread handle not inheritable
-        FALSE,          // Set handle inheritance to FALSE
-        CREATE_NO_WINDOW,
-        NULL,           // Use parent's environment block
-        currentDirectory,
-        &si,            // Pointer to STARTUPINFO structure
-        &pi             // Pointer to PROCESS_INFORMATION structure (removed extra parentheses)
-    );
+#include <omp.h>
+#include <unordered_set>
+#include <cmath>
+#include <ctime>
+
+// Draws the circle, with the sample loop specialized for the sample count. See DISPATCH_SAMPLE_COUNT.
+template <uint32_t SAMPLE_COUNT>
+static void DrawCircle(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, int minPixelX, int minPixelY, int maxPixelX, int maxPixelY, const Data::EntityCircle& circle, const Data::Point2D& center, const Data::ColorPMA& colorPMA)
+{
+    JitterSamples<SAMPLE_COUNT> jitter(document);
+    for (int iy = minPixelY; iy <= maxPixelY; ++iy)
+    {
+        Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX + minPixelX];
+        for (int ix = minPixelX; ix <= maxPixelX; ++ix)
+        {
+            // do multiple jittered samples per pixel and integrate (average) the result
+            Data::ColorPMA samplesColor;
+            Data::Point2D jitterRotation = GetJitterRotation(document, ix, iy);
+            for (uint32_t sampleIndex = 0; sampleIndex < jitter.Count(); ++sampleIndex)
+            {
+                Data::Point2D offset = GetJitterOffset(jitter.points[sampleIndex], jitterRotation);
 
-    // wait for it if we should
-    if (ret && waitForFinish)
-        WaitForSingleObject(pi.hProcess, INFINITE);
+                float canvasX, canvasY;
+                PixelToCanvas(document, float(ix) + offset.X, float(iy) + offset.Y, canvasX, canvasY);
 
-    // Close process and thread handles.
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
+                float distX = abs(canvasX - center.X);
+                float distY = abs(canvasY - center.Y);
+                float dist = (float)sqrt(distX * distX + distY * distY);
+
+                dist -= circle.innerRadius;
+
+                if (dist > 0.0f && dist <= circle.outerRadius)
+                {
+                    samplesColor.R += colorPMA.R / float(jitter.Count());
+                    samplesColor.G += colorPMA.G / float(jitter.Count());
+                    samplesColor.B += colorPMA.B / float(jitter.Count());
+                    samplesColor.A += colorPMA.A / float(jitter.Count());
+                }
+            }
+
+            // alpha blend the result in
+            *pixel = Blend(*pixel, samplesColor);
+            pixel++;
+        }
+    }
 }
 
 bool EntityCircle_Action::DoAction(
@@ -69,6 +82,16 @@ bool EntityCircle_Action::DoAction(
     Data::ColorPMA colorPMA = ToPremultipliedAlpha(circle.color);
 
     // Draw the circle
+    DISPATCH_SAMPLE_COUNT(document, DrawCircle, document, pixels, minPixelX, minPixelY, maxPixelX, maxPixelY, circle, center, colorPMA);
+
+    return true;
+}
+
+// Draws the expanded rectangle, with the sample loop specialized for the sample count. See DISPATCH_SAMPLE_COUNT.
+template <uint32_t SAMPLE_COUNT>
+static void DrawExpandedRectangle(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, int minPixelX, int minPixelY, int maxPixelX, int maxPixelY, const Data::EntityRectangle& rectangle, const Data::Point2D& center, const Data::ColorPMA& colorPMA)
+{
+    JitterSamples<SAMPLE_COUNT> jitter(document);
     for (int iy = minPixelY; iy <= maxPixelY; ++iy)
     {
         Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX + minPixelX];
@@ -76,35 +99,30 @@ bool EntityCircle_Action::DoAction(
         {
             // do multiple jittered samples per pixel and integrate (average) the result
             Data::ColorPMA samplesColor;
-            for (uint32_t sampleIndex = 0; sampleIndex < document.samplesPerPixel; ++sampleIndex)
+            Data::Point2D jitterRotation = GetJitterRotation(document, ix, iy);
+            for (uint32_t sampleIndex = 0; sampleIndex < jitter.Count(); ++sampleIndex)
             {
-                Data::Point2D offset = document.jitterSequence.points[sampleIndex];
+                Data::Point2D offset = GetJitterOffset(jitter.points[sampleIndex], jitterRotation);
 
                 float canvasX, canvasY;
                 PixelToCanvas(document, float(ix) + offset.X, float(iy) + offset.Y, canvasX, canvasY);
-                
-                float distX = abs(canvasX - center.X);
-                float distY = abs(canvasY - center.Y);
-                float dist = (float)sqrt(distX * distX + distY * distY);
 
-                dist -= circle.innerRadius;
+                float dist = sdBox(vec2{ canvasX, canvasY }, vec2{ center.X, center.Y }, vec2{ rectangle.radius.X, rectangle.radius.Y });
 
-                if (dist > 0.0f && dist <= circle.outerRadius)
+                if (dist <= rectangle.expansion)
                 {
-                    samplesColor.R += colorPMA.R / float(document.samplesPerPixel);
-                    samplesColor.G += colorPMA.G / float(document.samplesPerPixel);
-                    samplesColor.B += colorPMA.B / float(document.samplesPerPixel);
-                    samplesColor.A += colorPMA.A / float(document.samplesPerPixel);
+                    samplesColor.R += colorPMA.R / float(jitter.Count());
+                    samplesColor.G += colorPMA.G / float(jitter.Count());
+                    samplesColor.B += colorPMA.B / float(jitter.Count());
+                    samplesColor.A += colorPMA.A / float(jitter.Count());
                 }
             }
 
-            // alpha blend the result in
             *pixel = Blend(*pixel, samplesColor);
+
             pixel++;
         }
     }
-
-    return true;
 }
 
 bool EntityRectangle_Action::DoAction(
@@ -144,36 +162,7 @@ bool EntityRectangle_Action::DoAction(
     else
     {
         // Draw the rectangle
-        for (int iy = minPixelY; iy <= maxPixelY; ++iy)
-        {
-            Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX + minPixelX];
-            for (int ix = minPixelX; ix <= maxPixelX; ++ix)
-            {
-                // do multiple jittered samples per pixel and integrate (average) the result
-                Data::ColorPMA samplesColor;
-                for (uint32_t sampleIndex = 0; sampleIndex < document.samplesPerPixel; ++sampleIndex)
-                {
-                    Data::Point2D offset = document.jitterSequence.points[sampleIndex];
-
-                    float canvasX, canvasY;
-                    PixelToCanvas(document, float(ix) + offset.X, float(iy) + offset.Y, canvasX, canvasY);
-
-                    float dist = sdBox(vec2{ canvasX, canvasY }, vec2{ center.X, center.Y }, vec2{ rectangle.radius.X, rectangle.radius.Y });
-
-                    if (dist <= rectangle.expansion)
-                    {
-                        samplesColor.R += colorPMA.R / float(document.samplesPerPixel);
-                        samplesColor.G += colorPMA.G / float(document.samplesPerPixel);
-                        samplesColor.B += colorPMA.B / float(document.samplesPerPixel);
-                        samplesColor.A += colorPMA.A / float(document.samplesPerPixel);
-                    }
-                }
-
-                *pixel = Blend(*pixel, samplesColor);
-
-                pixel++;
-            }
-        }
+        DISPATCH_SAMPLE_COUNT(document, DrawExpandedRectangle, document, pixels, minPixelX, minPixelY, maxPixelX, maxPixelY, rectangle, center, colorPMA);
     }
 
     return true;
@@ -229,57 +218,129 @@ bool EntityCamera_Action::FrameInitialize(const Data::Document& document, Data::
     return true;
 }
 
-bool EntityLine3D_Action::DoAction(
-    const Data::Document& document,
+// Gets the combined transform and camera matrix, making it only once per frame for each (camera, transform) pair
+static bool GetWorldViewProjection(
     const std::unordered_map<std::string, Data::Entity>& entityMap,
-    std::vector<Data::ColorPMA>& pixels,
-    const Data::Entity& entity,
-    int threadId,
-    const EntityActionFrameContext& context)
+    const EntityActionFrameContext& context,
+    const char* entityType,
+    const std::string& cameraName,
+    const std::string& transformName,
+    WorldViewProjection& worldViewProjection)
 {
-    const Data::EntityLine3D& line3d = entity.data.line3d;
-    Data::Point3D offset = GetParentPosition(document, entityMap, entity);
+    auto cacheKey = std::make_pair(cameraName, transformName);
+    auto cacheIt = context.worldViewProjections.find(cacheKey);
+    if (cacheIt != context.worldViewProjections.end())
+    {
+        worldViewProjection = cacheIt->second;
+        return true;
+    }
 
     // get the camera
-    auto it = entityMap.find(line3d.camera);
+    auto it = entityMap.find(cameraName);
     if (it == entityMap.end())
     {
-        printf("Error: could not find line3d camera %s\n", line3d.camera.c_str());
+        printf("Error: could not find %s camera %s\n", entityType, cameraName.c_str());
         return false;
     }
     if (it->second.data._index != Data::EntityVariant::c_index_camera)
     {
-        printf("Error line3d camera was not a camera %s\n", line3d.camera.c_str());
+        printf("Error %s camera was not a camera %s\n", entityType, cameraName.c_str());
         return false;
     }
     const Data::EntityCamera& cameraEntity = it->second.data.camera;
+    worldViewProjection.perspective = cameraEntity.perspective;
 
     // Get the world matrix
-    Data::Matrix4x4 transform;
-    if (!line3d.transform.empty())
+    if (!transformName.empty())
     {
-        auto it = entityMap.find(line3d.transform);
+        auto it = entityMap.find(transformName);
         if (it == entityMap.end())
         {
-            printf("Error: could not find line3d transform %s\n", line3d.transform.c_str());
+            printf("Error: could not find %s transform %s\n", entityType, transformName.c_str());
             return false;
         }
         if (it->second.data._index != Data::EntityVariant::c_index_transform)
         {
-            printf("Error line3d camera was not a camera %s\n", line3d.transform.c_str());
+            printf("Error %s transform was not a transform %s\n", entityType, transformName.c_str());
             return false;
         }
-        transform = Multiply(it->second.data.transform.mtx, cameraEntity.viewProj);
+        worldViewProjection.mtx = Multiply(it->second.data.transform.mtx, cameraEntity.viewProj);
     }
     else
     {
-        transform = cameraEntity.viewProj;
+        worldViewProjection.mtx = cameraEntity.viewProj;
+    }
+
+    context.worldViewProjections[cacheKey] = worldViewProjection;
+    return true;
+}
+
+// Makes 2d line segments out of projected points, leaving out the segments that can't be seen:
+// ones entirely behind a perspective camera, and ones entirely off the screen.
+// If strip is true, the points are a line strip, else they are pairs of points.
+static void MakeVisibleLineSegments(const Data::Document& document, const std::vector<Data::Point4D>& projectedPoints, bool strip, bool perspective, float width, std::vector<Data::Point2D>& segmentPoints)
+{
+    float canvasMinX, canvasMinY, canvasMaxX, canvasMaxY;
+    GetCanvasExtents(document, canvasMinX, canvasMinY, canvasMaxX, canvasMaxY);
+    canvasMinX -= width;
+    canvasMinY -= width;
+    canvasMaxX += width;
+    canvasMaxY += width;
+
+    // The perspective projection puts -0.01 * view z into w, so w is negative in front of the camera
+    auto BehindCamera = [perspective](const Data::Point4D& p)
+    {
+        return perspective && p.W >= 0.0f;
+    };
+
+    segmentPoints.clear();
+    size_t step = strip ? 1 : 2;
+    for (size_t index = 0; index + 1 < projectedPoints.size(); index += step)
+    {
+        const Data::Point4D& A = projectedPoints[index];
+        const Data::Point4D& B = projectedPoints[index + 1];
+
+        if (BehindCamera(A) && BehindCamera(B))
+            continue;
+
+        // homogeneous divide
+        Data::Point2D A2D{ A.X / A.W, A.Y / A.W };
+        Data::Point2D B2D{ B.X / B.W, B.Y / B.W };
+
+        if (Max(A2D.X, B2D.X) < canvasMinX || Min(A2D.X, B2D.X) > canvasMaxX ||
+            Max(A2D.Y, B2D.Y) < canvasMinY || Min(A2D.Y, B2D.Y) > canvasMaxY)
+            continue;
+
+        segmentPoints.push_back(A2D);
+        segmentPoints.push_back(B2D);
     }
+}
+
+bool EntityLine3D_Action::DoAction(
+    const Data::Document& document,
+    const std::unordered_map<std::string, Data::Entity>& entityMap,
+    std::vector<Data::ColorPMA>& pixels,
+    const Data::Entity& entity,
+    int threadId,
+    const EntityActionFrameContext& context)
+{
+    const Data::EntityLine3D& line3d = entity.data.line3d;
+    Data::Point3D offset = GetParentPosition(document, entityMap, entity);
+
+    WorldViewProjection worldViewProjection;
+    if (!GetWorldViewProjection(entityMap, context, "line3d", line3d.camera, line3d.transform, worldViewProjection))
+        return false;
+
+    // project the line and see if it can be seen
+    std::vector<Data::Point4D> projectedPoints;
+    ProjectPoints3D({ line3d.A, line3d.B }, offset, worldViewProjection.mtx, projectedPoints);
+
+    std::vector<Data::Point2D> segmentPoints;
+    MakeVisibleLineSegments(document, projectedPoints, false, worldViewProjection.perspective, line3d.width, segmentPoints);
 
     // draw the line
-    Data::Point2D A = ProjectPoint3DToPoint2D(line3d.A + offset, transform);
-    Data::Point2D B = ProjectPoint3DToPoint2D(line3d.B + offset, transform);
-    DrawLine(document, pixels, A, B, line3d.width, ToPremultipliedAlpha(line3d.color));
+    if (!segmentPoints.empty())
+        DrawLine(document, pixels, segmentPoints[0], segmentPoints[1], line3d.width, ToPremultipliedAlpha(line3d.color));
 
     return true;
 }
@@ -295,54 +356,23 @@ bool EntityLines3D_Action::DoAction(
     const Data::EntityLines3D& lines3d = entity.data.lines3d;
     Data::Point3D offset = GetParentPosition(document, entityMap, entity);
 
-    // get the camera
-    auto it = entityMap.find(lines3d.camera);
-    if (it == entityMap.end())
-    {
-        printf("Error: could not find lines3d camera %s\n", lines3d.camera.c_str());
-        return false;
-    }
-    if (it->second.data._index != Data::EntityVariant::c_index_camera)
-    {
-        printf("Error lines3d camera was not a camera %s\n", lines3d.camera.c_str());
+    WorldViewProjection worldViewProjection;
+    if (!GetWorldViewProjection(entityMap, context, "lines3d", lines3d.camera, lines3d.transform, worldViewProjection))
         return false;
-    }
-    const Data::EntityCamera& cameraEntity = it->second.data.camera;
 
     // need at least 2 points to make a line
     if (lines3d.points.size() < 2)
         return true;
 
-    // Get the world matrix
-    Data::Matrix4x4 transform;
-    if (!lines3d.transform.empty())
-    {
-        auto it = entityMap.find(lines3d.transform);
-        if (it == entityMap.end())
-        {
-            printf("Error: could not find lines3d transform %s\n", lines3d.transform.c_str());
-            return false;
-        }
-        if (it->second.data._index != Data::EntityVariant::c_index_transform)
-        {
-            printf("Error lines3d camera was not a camera %s\n", lines3d.transform.c_str());
-            return false;
-        }
-        transform = Multiply(it->second.data.transform.mtx, cameraEntity.viewProj);
-    }
-    else
-    {
-        transform = cameraEntity.viewProj;
-    }
+    // project all the points at once, and make the line segments between them that can be seen
+    std::vector<Data::Point4D> projectedPoints;
+    ProjectPoints3D(lines3d.points, offset, worldViewProjection.mtx, projectedPoints);
+
+    std::vector<Data::Point2D> segmentPoints;
+    MakeVisibleLineSegments(document, projectedPoints, true, worldViewProjection.perspective, lines3d.width, segmentPoints);
 
     // draw the lines
-    Data::Point2D lastPoint = ProjectPoint3DToPoint2D(lines3d.points[0] + offset, transform);
-    for (int pointIndex = 1; pointIndex < lines3d.points.size(); ++pointIndex)
-    {
-        Data::Point2D nextPoint = ProjectPoint3DToPoint2D(lines3d.points[pointIndex] + offset, transform);
-        DrawLine(document, pixels, lastPoint, nextPoint, lines3d.width, ToPremultipliedAlpha(lines3d.color));
-        lastPoint = nextPoint;
-    }
+    DrawLineSegments(document, pixels, segmentPoints, lines3d.width, ToPremultipliedAlpha(lines3d.color));
 
     return true;
 }
@@ -366,96 +396,423 @@ bool EntityTransform_Action::FrameInitialize(const Data::Document& document, Dat
     return true;
 }
 
-static bool GetOrMakeLatexImage(const char* latexBinaries, const char* latex, int DPI, uint32_t& width, uint32_t& height, unsigned char*& pixels, int threadId)
+static int GetLatexDPI(const Data::Document& document, float scale)
+{
+    // At 1920x1080, a scale of 1.0 gives you 300 DPI rendering from latex.
+    // Not the most elegant thing, but it makes it resolution independent.
+    return int((float(CanvasSizeInPixels(document)) / 1080.0f) * scale * 300.0f);
+}
+
+// Latex is only rendered at a power of two multiple of this DPI, and resampled down to the DPI actually wanted.
+// That way an animated scale only needs a latex run per octave, instead of one for every frame.
+static const int c_latexReferenceDPI = 300;
+
+static int GetLatexLevelDPI(int level)
+{
+    return Max(int(std::ldexp(float(c_latexReferenceDPI), level)), 1);
+}
+
+// returns the smallest level that has at least the DPI asked for
+static int GetLatexLevel(int DPI)
+{
+    int level = int(std::ceil(std::log2(float(DPI) / float(c_latexReferenceDPI))));
+    while (GetLatexLevelDPI(level) < DPI)
+        level++;
+    while (GetLatexLevelDPI(level - 1) >= DPI && GetLatexLevelDPI(level - 1) < GetLatexLevelDPI(level))
+        level--;
+    return level;
+}
+
+// Resizes a latex image with a box filter, where each destination pixel is the area weighted average of the source
+// pixels it covers. Only used to make images smaller.
+static void ResampleLatexImage(const uint8_t* src, int srcWidth, int srcHeight, std::vector<uint8_t>& dest, int destWidth, int destHeight)
+{
+    // For each destination pixel on an axis, find the source pixels it covers and how much of each it covers
+    struct Taps
+    {
+        int maxTaps = 0;
+        std::vector<int> first;
+        std::vector<float> weights;
+    };
+
+    auto MakeTaps = [](int srcSize, int destSize, Taps& taps)
+    {
+        float srcPerDest = float(srcSize) / float(destSize);
+        taps.maxTaps = int(std::ceil(srcPerDest)) + 1;
+        taps.first.resize(destSize);
+        taps.weights.resize(destSize * taps.maxTaps, 0.0f);
+
+        for (int destIndex = 0; destIndex < destSize; ++destIndex)
+        {
+            float begin = float(destIndex) * srcPerDest;
+            float end = Min(float(destIndex + 1) * srcPerDest, float(srcSize));
+            taps.first[destIndex] = int(begin);
+
+            float* weights = &taps.weights[destIndex * taps.maxTaps];
+            for (int tapIndex = 0; tapIndex < taps.maxTaps; ++tapIndex)
+            {
+                float pixelBegin = float(taps.first[destIndex] + tapIndex);
+                float overlap = Min(end, pixelBegin + 1.0f) - Max(begin, pixelBegin);
+                weights[tapIndex] = Max(overlap, 0.0f) / srcPerDest;
+            }
+        }
+    };
+
+    Taps tapsX, tapsY;
+    MakeTaps(srcWidth, destWidth, tapsX);
+    MakeTaps(srcHeight, destHeight, tapsY);
+
+    // resize on the x axis
+    std::vector<float> temp(srcHeight * destWidth);
+    for (int iy = 0; iy < srcHeight; ++iy)
+    {
+        const uint8_t* srcRow = &src[iy * srcWidth];
+        float* tempRow = &temp[iy * destWidth];
+        for (int ix = 0; ix < destWidth; ++ix)
+        {
+            const float* weights = &tapsX.weights[ix * tapsX.maxTaps];
+            int first = tapsX.first[ix];
+            int count = Min(tapsX.maxTaps, srcWidth - first);
+
+            float value = 0.0f;
+            for (int tapIndex = 0; tapIndex < count; ++tapIndex)
+                value += float(srcRow[first + tapIndex]) * weights[tapIndex];
+            tempRow[ix] = value;
+        }
+    }
+
+    // resize on the y axis
+    dest.resize(destWidth * destHeight);
+    for (int iy = 0; iy < destHeight; ++iy)
+    {
+        const float* weights = &tapsY.weights[iy * tapsY.maxTaps];
+        int first = tapsY.first[iy];
+        int count = Min(tapsY.maxTaps, srcHeight - first);
+
+        uint8_t* destRow = &dest[iy * destWidth];
+        for (int ix = 0; ix < destWidth; ++ix)
+        {
+            float value = 0.0f;
+            for (int tapIndex = 0; tapIndex < count; ++tapIndex)
+                value += temp[(first + tapIndex) * destWidth + ix] * weights[tapIndex];
+            destRow[ix] = (uint8_t)Clamp(value + 0.5f, 0.0f, 255.0f);
+        }
+    }
+}
+
+static size_t GetLatexImageKey(const char* latex, int DPI)
 {
-    // try and get the data from the CAS
     size_t hash = 0;
     Hash(hash, latex);
     Hash(hash, DPI);
-    unsigned char* data = (unsigned char*)CAS::Get().Get(hash);
+    return hash;
+}
 
-    // if it doesn't exist, create it
-    if (!data)
+struct LatexImageRequest
+{
+    const char* latex;
+    int DPI;
+    size_t hash;
+};
+
+// Makes the requested latex images and stores them in the CAS. Every unique latex string becomes a page of a single
+// document, so latex runs once, and dvipng runs once per unique DPI. Process startup is most of the cost of small
+// formulas, so this is a lot faster than a latex run per image.
+// jobName is used for the temporary files in build/ so must be unique among jobs running at the same time.
+static bool MakeLatexImages(const char* latexBinaries, const std::vector<LatexImageRequest>& requests, const char* jobName)
+{
+#ifdef _WIN32
+    const char* exeExtension = ".exe";
+#else
+    const char* exeExtension = "";
+#endif
+
+    char buffer[4096];
+    char fileName[4096];
+
+    // give each unique latex string a page. Page numbers start at 1, like dvipng wants.
+    std::unordered_map<std::string, int> latexPages;
+    std::vector<int> requestPages(requests.size());
+    for (size_t requestIndex = 0; requestIndex < requests.size(); ++requestIndex)
     {
-        char buffer[4096];
-        char buffer2[4096];
+        auto it = latexPages.find(requests[requestIndex].latex);
+        if (it == latexPages.end())
+            it = latexPages.insert({ requests[requestIndex].latex, (int)latexPages.size() + 1 }).first;
+        requestPages[requestIndex] = it->second;
+    }
 
-        // make the latex file
+    // make the latex file. Each preview environment is shipped out as it's own page, the same as a standalone document
+    // with the preview option. The page number is set explicitly so that a latex error on one page can't shift the
+    // page numbers of the pages after it.
+    {
+        std::vector<const char*> pageLatex(latexPages.size());
+        for (const auto& pair : latexPages)
+            pageLatex[pair.second - 1] = pair.first.c_str();
+
+        sprintf_s(buffer, "build/%s.tex", jobName);
+        FILE* file = nullptr;
+        fopen_s(&file, buffer, "wb");
+        if (!file)
         {
-            sprintf_s(buffer, "build/latex%i.tex", threadId);
-            FILE* file = nullptr;
-            fopen_s(&file, buffer, "wb");
-            if (!file)
-            {
-                printf("Could not open file for write: %s\n", buffer);
-                return false;
-            }
+            printf("Could not open file for write: %s\n", buffer);
+            return false;
+        }
+
+        fprintf(file,
+            "\\documentclass{article}\n"
+            "\\usepackage[active,tightpage]{preview}\n"
+            "\\begin{document}\n"
+        );
 
+        for (size_t pageIndex = 0; pageIndex < pageLatex.size(); ++pageIndex)
+        {
             fprintf(file,
-                "\\documentclass[preview]{standalone}\n"
-                "\\begin{document}\n"
+                "\\setcounter{page}{%i}\n"
+                "\\begin{preview}\n"
                 "%s\n"
-                "\\end{document}\n",
-                latex
+                "\\end{preview}\n",
+                (int)pageIndex + 1,
+                pageLatex[pageIndex]
             );
+        }
+
+        fprintf(file, "\\end{document}\n");
 
-            fclose(file);
+        fclose(file);
+    }
+
+    // Make the dvi. Delete the old one first, so that if latex fails, dvipng can't render an earlier batch's pages.
+    // Only images written after this point are used.
+    int64_t runStartTime = (int64_t)time(nullptr);
+    std::string dviFileName = std::string("build/") + jobName + ".dvi";
+    remove(dviFileName.c_str());
+    sprintf_s(buffer, "%slatex%s", latexBinaries, exeExtension);
+    sprintf_s(fileName, "build/%s.tex", jobName);
+    bool latexSucceeded = RunProcess(buffer, { "-output-directory=build", "-interaction=nonstopmode", fileName });
+
+    // convert the pages to pngs, once for each DPI
+    std::unordered_set<int> failedDPIs;
+    if (latexSucceeded)
+    {
+        std::unordered_map<int, std::vector<int>> DPIPages;
+        for (size_t requestIndex = 0; requestIndex < requests.size(); ++requestIndex)
+        {
+            std::vector<int>& pages = DPIPages[requests[requestIndex].DPI];
+            if (std::find(pages.begin(), pages.end(), requestPages[requestIndex]) == pages.end())
+                pages.push_back(requestPages[requestIndex]);
         }
 
-        // make a dvi and then convert it to a png
+        sprintf_s(buffer, "%sdvipng%s", latexBinaries, exeExtension);
+        for (const auto& pair : DPIPages)
         {
-            char currentDirectory[1024];
-            GetCurrentDirectoryA(1024, currentDirectory);
-            strcat_s(currentDirectory, "\\build\\");
+            // delete old output so a page that failed isn't loaded from an earlier run
+            std::string pageList;
+            for (int page : pair.second)
+            {
+                sprintf_s(fileName, "build/%s_%i_%i.png", jobName, pair.first, page);
+                remove(fileName);
 
-            sprintf_s(buffer, "%slatex.exe", latexBinaries);
-            sprintf_s(buffer2, "-output-directory=./ -interaction=nonstopmode latex%i.tex", threadId);
-            Run(buffer, buffer2, currentDirectory);
+                if (!pageList.empty())
+                    pageList += ",";
+                pageList += std::to_string(page);
+            }
 
-            sprintf_s(buffer, "%sdvipng.exe", latexBinaries);
-            sprintf_s(buffer2, "-T tight -D %i -o latex%i.png latex%i.dvi", DPI, threadId, threadId);
-            Run(buffer, buffer2, currentDirectory);
+            sprintf_s(fileName, "build/%s_%i_%%d.png", jobName, pair.first);
+            if (!RunProcess(buffer, { "-T", "tight", "-D", std::to_string(pair.first), "-pp", pageList, "-o", fileName, dviFileName }))
+                failedDPIs.insert(pair.first);
         }
+    }
 
-        // load the image, store it in the cache and then get it again
+    // load the images and store them in the cache. If latex failed, every request failed.
+    std::vector<LatexImageRequest> failedRequests;
+    for (size_t requestIndex = 0; requestIndex < requests.size(); ++requestIndex)
+    {
+        const LatexImageRequest& request = requests[requestIndex];
+        sprintf_s(fileName, "build/%s_%i_%i.png", jobName, request.DPI, requestPages[requestIndex]);
+
+        int64_t modifiedTime = 0;
+        if (!latexSucceeded || failedDPIs.count(request.DPI) > 0 || !GetFileModifiedTime(fileName, modifiedTime) || modifiedTime < runStartTime)
         {
-            sprintf_s(buffer, "build/latex%i.png", threadId);
+            failedRequests.push_back(request);
+            continue;
+        }
 
-            int w, h, channels;
-            stbi_uc* filePixels = stbi_load(buffer, &w, &h, &channels, 1);
+        int w, h, channels;
+        stbi_uc* filePixels = stbi_load(fileName, &w, &h, &channels, 1);
 
-            if (filePixels == nullptr)
-            {
-                printf("could not load file %s\n", buffer);
-                return false;
-            }
+        if (filePixels == nullptr)
+        {
+            failedRequests.push_back(request);
+            continue;
+        }
 
-            // store this data in the CAS
-            width = w;
-            height = h;
-            std::vector<unsigned char> newData;
-            newData.resize(sizeof(width) + sizeof(height) + width * height);
-            *((uint32_t*)&newData[sizeof(uint32_t) * 0]) = width;
-            *((uint32_t*)&newData[sizeof(uint32_t) * 1]) = height;
-            memcpy(&newData[sizeof(uint32_t) * 2], filePixels, width * height);
-            CAS::Set(hash, newData, false);
+        // store this data in the CAS
+        uint32_t width = w;
+        uint32_t height = h;
+        std::vector<unsigned char> newData;
+        newData.resize(sizeof(width) + sizeof(height) + width * height);
+        *((uint32_t*)&newData[sizeof(uint32_t) * 0]) = width;
+        *((uint32_t*)&newData[sizeof(uint32_t) * 1]) = height;
+        memcpy(&newData[sizeof(uint32_t) * 2], filePixels, width * height);
+        CAS::Set(request.hash, CAS::KeyClass::Latex, newData, false, true);
 
-            // free the memory
-            stbi_image_free(filePixels);
-        }
+        // free the memory
+        stbi_image_free(filePixels);
+    }
+
+    if (failedRequests.empty())
+        return true;
+
+    // A single request failing means the latex is bad or latex isn't set up right
+    if (requests.size() == 1)
+    {
+        printf("could not make latex image for \"%s\"\n", requests[0].latex);
+        return false;
+    }
+
+    // A latex error can mess up the pages after it, so try the failed ones again individually
+    bool ret = true;
+    for (const LatexImageRequest& request : failedRequests)
+        ret &= MakeLatexImages(latexBinaries, { request }, jobName);
+    return ret;
+}
+
+static bool GetOrMakeLatexImage(const char* latexBinaries, const char* latex, int DPI, CAS::Handle& data, uint32_t& width, uint32_t& height, const unsigned char*& pixels, int threadId)
+{
+    // try and get the data from the CAS
+    size_t hash = GetLatexImageKey(latex, DPI);
+    data = CAS::Get().Get(hash, CAS::KeyClass::Latex);
+
+    // if it doesn't exist, create it, then get it from the CAS now that we have set it
+    if (!data)
+    {
+        // another process sharing the CAS may be making it already. If so, wait for it and use theirs.
+        CAS::MakeLock makeLock;
+        CAS::Get().LockForMaking(hash, makeLock);
+        data = CAS::Get().Get(hash, CAS::KeyClass::Latex);
+
+        if (!data)
+        {
+            // the job name is unique, so processes and threads making latex at the same time don't share files
+            char jobName[256];
+            sprintf_s(jobName, "latex%i_%i", GetPID(), threadId);
+            if (!MakeLatexImages(latexBinaries, { { latex, DPI, hash } }, jobName))
+                return false;
 
-        // Get the data from the CAS now that we have set it
-        data = (unsigned char*)CAS::Get().Get(hash);
+            data = CAS::Get().Get(hash, CAS::KeyClass::Latex);
+            if (!data)
+                return false;
+        }
     }
 
     // set the data we got from the CAS
-    width = ((uint32_t*)data)[0];
-    height = ((uint32_t*)data)[1];
-    pixels = &data[sizeof(uint32_t) * 2];
+    width = data.As<uint32_t>()[0];
+    height = data.As<uint32_t>()[1];
+    pixels = &data.As<unsigned char>()[sizeof(uint32_t) * 2];
 
     return true;
 }
 
+void PrefetchLatexImages(const Data::Document& document)
+{
+    // gather the unique latex images used by the entities and keyframes, that aren't already in the CAS
+    std::vector<LatexImageRequest> requests;
+    {
+        std::unordered_set<size_t> seen;
+        auto AddRequest = [&](const std::string& latex, int level)
+        {
+            LatexImageRequest request;
+            request.latex = latex.c_str();
+            request.DPI = GetLatexLevelDPI(level);
+            request.hash = GetLatexImageKey(request.latex, request.DPI);
+
+            if (!seen.insert(request.hash).second)
+                return;
+
+            if (!CAS::Get().Get(request.hash, CAS::KeyClass::Latex))
+                requests.push_back(request);
+        };
+
+        for (const Data::RuntimeEntityTimeline* timeline : document.runtimeEntityTimelines)
+        {
+            const Data::EntityLatex* lastLatex = nullptr;
+            for (const Data::RuntimeEntityTimelineKeyframe& keyFrame : timeline->keyFrames)
+            {
+                if (keyFrame.entity.data._index != Data::EntityVariant::c_index_latex)
+                    continue;
+
+                const Data::EntityLatex& latex = keyFrame.entity.data.latex;
+                int DPI = GetLatexDPI(document, latex.scale);
+                if (DPI < 1)
+                {
+                    lastLatex = &latex;
+                    continue;
+                }
+
+                // get the levels used while blending from the last keyframe, for both the old and new latex
+                int minLevel = GetLatexLevel(DPI);
+                int maxLevel = minLevel;
+                if (lastLatex)
+                {
+                    int lastDPI = GetLatexDPI(document, lastLatex->scale);
+                    if (lastDPI >= 1)
+                    {
+                        minLevel = Min(minLevel, GetLatexLevel(lastDPI));
+                        maxLevel = Max(maxLevel, GetLatexLevel(lastDPI));
+                    }
+                    else
+                        minLevel = GetLatexLevel(1);
+                }
+
+                for (int level = minLevel; level <= maxLevel; ++level)
+                {
+                    AddRequest(latex.latex, level);
+                    if (lastLatex)
+                        AddRequest(lastLatex->latex, level);
+                }
+
+                lastLatex = &latex;
+            }
+        }
+    }
+
+    if (requests.empty())
+        return;
+
+    // Each batch is a single latex run, so fewer batches means less process startup time, but latex is single threaded
+    // so run a few batches at once when there are enough images to be worth it.
+    static const int c_minLatexBatchSize = 8;
+    int jobCount = (document.config.latexJobs > 0) ? document.config.latexJobs : omp_get_num_procs();
+    int batchCount = Clamp(((int)requests.size() + c_minLatexBatchSize - 1) / c_minLatexBatchSize, 1, Max(jobCount, 1));
+
+    printf("Making %i latex images in %i batches...\n", (int)requests.size(), batchCount);
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(batchCount)
+    for (int batchIndex = 0; batchIndex < batchCount; ++batchIndex)
+    {
+        size_t begin = requests.size() * batchIndex / batchCount;
+        size_t end = requests.size() * (batchIndex + 1) / batchCount;
+
+        // Skip images that another process sharing the CAS is making. If they aren't done by the time they are
+        // rendered, rendering waits for them.
+        CAS::MakeLock makeLock;
+        std::vector<LatexImageRequest> batchRequests;
+        for (size_t requestIndex = begin; requestIndex < end; ++requestIndex)
+        {
+            if (CAS::Get().LockForMaking(requests[requestIndex].hash, makeLock, false) && !CAS::Get().Get(requests[requestIndex].hash, CAS::KeyClass::Latex))
+                batchRequests.push_back(requests[requestIndex]);
+        }
+
+        if (batchRequests.empty())
+            continue;
+
+        // Note: errors are reported, but not fatal. The latex just won't show up when rendering.
+        char jobName[256];
+        sprintf_s(jobName, "latexprefetch%i_%i", GetPID(), batchIndex);
+        MakeLatexImages(document.config.latexbinaries.c_str(), batchRequests, jobName);
+    }
+}
+
 bool EntityLatex_Action::DoAction(
     const Data::Document& document,
     const std::unordered_map<std::string, Data::Entity>& entityMap,
@@ -466,16 +823,32 @@ bool EntityLatex_Action::DoAction(
 {
     const Data::EntityLatex& latex = entity.data.latex;
 
+    CAS::Handle imageData;
     uint32_t imageWidth, imageHeight;
-    unsigned char* imagePixels;
+    const unsigned char* imagePixels;
+    std::vector<uint8_t> resampledPixels;
     {
-        // At 1920x1080, a scale of 1.0 gives you 300 DPI rendering from latex.
-        // Not the most elegant thing, but it makes it resolution independent.
-        int DPI = int((float(CanvasSizeInPixels(document)) / 1080.0f) * latex.scale * 300.0f);
+        int DPI = GetLatexDPI(document, latex.scale);
+        if (DPI < 1)
+            return true;
 
         // Note: don't return false on latex errors. We want to just not show text if latex is misconfigured.
-        if (!GetOrMakeLatexImage(document.config.latexbinaries.c_str(), latex.latex.c_str(), DPI, imageWidth, imageHeight, imagePixels, threadId))
+        int levelDPI = GetLatexLevelDPI(GetLatexLevel(DPI));
+        if (!GetOrMakeLatexImage(document.config.latexbinaries.c_str(), latex.latex.c_str(), levelDPI, imageData, imageWidth, imageHeight, imagePixels, threadId))
             return true;
+
+        // shrink the image from the level's DPI to the DPI we want
+        if (levelDPI != DPI)
+        {
+            float ratio = float(DPI) / float(levelDPI);
+            int resampledWidth = Max(int(float(imageWidth) * ratio + 0.5f), 1);
+            int resampledHeight = Max(int(float(imageHeight) * ratio + 0.5f), 1);
+            ResampleLatexImage(imagePixels, imageWidth, imageHeight, resampledPixels, resampledWidth, resampledHeight);
+
+            imageWidth = resampledWidth;
+            imageHeight = resampledHeight;
+            imagePixels = resampledPixels.data();
+        }
     }
 
     Data::Point2D offset = Point3D_XY(GetParentPosition(document, entityMap, entity));
@@ -544,6 +917,49 @@ bool EntityLinearGradient_Action::Initialize(const Data::Document& document, Dat
     return true;
 }
 
+static Data::ColorPMA EvaluateLinearGradient(const Data::EntityLinearGradient& linearGradient, float value)
+{
+    auto it = std::lower_bound(
+        linearGradient.points.begin(),
+        linearGradient.points.end(),
+        value,
+        [] (const Data::GradientPoint& p, float v)
+        {
+            return p.value < v;
+        }
+    );
+
+    // if the value is beyond the control points, use the last color
+    Data::Color color;
+    if (it == linearGradient.points.end())
+    {
+        color = linearGradient.points.rbegin()->color;
+    }
+    // else if the value is lower than the first control point, use the first color
+    else if (it == linearGradient.points.begin())
+    {
+        color = linearGradient.points.begin()->color;
+    }
+    // else we are between two control points, do a cubic bezier interpolation
+    else
+    {
+        int index = int(it - linearGradient.points.begin());
+
+        float percent = (value - linearGradient.points[index - 1].value) / (linearGradient.points[index].value - linearGradient.points[index - 1].value);
+
+        float CP0 = linearGradient.points[index].blendControlPoints.A;
+        float CP1 = linearGradient.points[index].blendControlPoints.B;
+        float CP2 = linearGradient.points[index].blendControlPoints.C;
+        float CP3 = linearGradient.points[index].blendControlPoints.D;
+
+        float t = CubicBezierInterpolation(CP0, CP1, CP2, CP3, percent);
+
+        Lerp(linearGradient.points[index - 1].color, linearGradient.points[index].color, color, t);
+    }
+
+    return ToPremultipliedAlpha(color);
+}
+
 bool EntityLinearGradient_Action::DoAction(
     const Data::Document& document,
     const std::unordered_map<std::string, Data::Entity>& entityMap,
@@ -552,68 +968,120 @@ bool EntityLinearGradient_Action::DoAction(
     int threadId,
     const EntityActionFrameContext& context)
 {
+    // How many lookup table entries there are per pixel along the gradient axis, and the most entries to make
+    static const float c_lutSamplesPerPixel = 4.0f;
+    static const int c_lutMaxSize = 65536;
+
     const Data::EntityLinearGradient& linearGradient = entity.data.linearGradient;
 
     // no colors, no gradient
     if (linearGradient.points.size() == 0)
         return true;
 
-    // draw the gradient
-    Data::ColorPMA* pixel = pixels.data();
-    for (int iy = 0; iy < document.renderSizeY; ++iy)
+    // The gradient value is the projection of the canvas position onto the half space, which is linear in pixel space.
+    // Get how much it changes per pixel on each axis.
+    float valueOriginX, valueOriginY;
+    PixelToCanvas(document, 0, 0, valueOriginX, valueOriginY);
+    float valueOrigin = Dot(linearGradient.halfSpace, Data::Point3D{ valueOriginX, valueOriginY, 1.0f });
+    float valueDeltaX = linearGradient.halfSpace.X * 100.0f / float(CanvasSizeInPixels(document));
+    float valueDeltaY = -linearGradient.halfSpace.Y * 100.0f / float(CanvasSizeInPixels(document));
+
+    // The color is constant beyond the first and last gradient points, so the lookup table only needs
+    // to cover the part of the screen's value range that is between them.
+    float cornerValue00 = valueOrigin;
+    float cornerValue10 = valueOrigin + valueDeltaX * float(document.renderSizeX - 1);
+    float cornerValue01 = valueOrigin + valueDeltaY * float(document.renderSizeY - 1);
+    float cornerValue11 = cornerValue10 + valueDeltaY * float(document.renderSizeY - 1);
+    float firstPointValue = linearGradient.points.begin()->value;
+    float lastPointValue = linearGradient.points.rbegin()->value;
+    float lutMinValue = Clamp(Min(cornerValue00, cornerValue10, cornerValue01, cornerValue11), firstPointValue, lastPointValue);
+    float lutMaxValue = Clamp(Max(cornerValue00, cornerValue10, cornerValue01, cornerValue11), firstPointValue, lastPointValue);
+
+    // size the lookup table to have a few entries per pixel along the gradient axis
+    float valuePerPixel = (float)sqrt(valueDeltaX * valueDeltaX + valueDeltaY * valueDeltaY);
+    int lutSize = 1;
+    if (valuePerPixel > 0.0f && lutMaxValue > lutMinValue)
+        lutSize = Clamp(int(ceil(c_lutSamplesPerPixel * (lutMaxValue - lutMinValue) / valuePerPixel)) + 1, 2, c_lutMaxSize);
+    float lutScale = (lutSize > 1) ? float(lutSize - 1) / (lutMaxValue - lutMinValue) : 0.0f;
+
+    // bake the gradient into the lookup table
+    std::vector<Data::ColorPMA> lut(lutSize);
+    bool opaque = true;
+    for (int index = 0; index < lutSize; ++index)
     {
-        for (int ix = 0; ix < document.renderSizeX; ++ix)
-        {
-            float canvasX, canvasY;
-            PixelToCanvas(document, float(ix), float(iy), canvasX, canvasY);
-
-            float value = Dot(linearGradient.halfSpace, Data::Point3D{ canvasX, canvasY, 1.0f });
+        float value = (lutSize > 1) ? Lerp(lutMinValue, lutMaxValue, float(index) / float(lutSize - 1)) : lutMinValue;
+        lut[index] = EvaluateLinearGradient(linearGradient, value);
+        opaque = opaque && lut[index].A >= 1.0f;
+    }
 
-            auto it = std::lower_bound(
-                linearGradient.points.begin(),
-                linearGradient.points.end(),
-                value,
-                [] (const Data::GradientPoint& p, float v)
-                {
-                    return p.value < v;
-                }
-            );
+    // draw the gradient, stepping through the lookup table along each row.
+    // If the gradient is opaque, blending would just give the gradient color, so write it directly.
+    float lutPosDeltaX = valueDeltaX * lutScale;
+    for (int iy = 0; iy < document.renderSizeY; ++iy)
+    {
+        float lutPosRowStart = (valueOrigin + valueDeltaY * float(iy) - lutMinValue) * lutScale + 0.5f;
+        Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX];
 
-            // if the value is beyond the control points, use the last color
-            Data::Color color;
-            if (it == linearGradient.points.end())
+        if (opaque)
+        {
+            for (int ix = 0; ix < document.renderSizeX; ++ix)
             {
-                color = linearGradient.points.rbegin()->color;
+                int lutIndex = Clamp(int(lutPosRowStart + lutPosDeltaX * float(ix)), 0, lutSize - 1);
+                *pixel = lut[lutIndex];
+                pixel++;
             }
-            // else if the value is lower than the first control point, use the first color
-            else if (it == linearGradient.points.begin())
+        }
+        else
+        {
+            for (int ix = 0; ix < document.renderSizeX; ++ix)
             {
-                color = linearGradient.points.begin()->color;
+                int lutIndex = Clamp(int(lutPosRowStart + lutPosDeltaX * float(ix)), 0, lutSize - 1);
+                *pixel = Blend(*pixel, lut[lutIndex]);
+                pixel++;
             }
-            // else we are between two control points, do a cubic bezier interpolation
-            else
-            {
-                int index = int(it - linearGradient.points.begin());
-
-                float percent = (value - linearGradient.points[index - 1].value) / (linearGradient.points[index].value - linearGradient.points[index - 1].value);
+        }
+    }
 
-                float CP0 = linearGradient.points[index].blendControlPoints.A;
-                float CP1 = linearGradient.points[index].blendControlPoints.B;
-                float CP2 = linearGradient.points[index].blendControlPoints.C;
-                float CP3 = linearGradient.points[index].blendControlPoints.D;
+    return true;
+}
 
-                float t = CubicBezierInterpolation(CP0, CP1, CP2, CP3, percent);
+static void GetOrMakeDigitalDissolveThresholds(const Data::Document& document, const Data::Point2D& scale, CAS::Handle& thresholds)
+{
+    // try and get the data from the CAS
+    size_t hash = 0;
+    Hash(hash, "DigitalDissolveThresholds");
+    Hash(hash, document.renderSizeX);
+    Hash(hash, document.renderSizeY);
+    Hash(hash, document.blueNoiseWidth);
+    Hash(hash, document.blueNoiseHeight);
+    Hash(hash, scale);
+    thresholds = CAS::Get().Get(hash, CAS::KeyClass::DigitalDissolve);
 
-                Lerp(linearGradient.points[index - 1].color, linearGradient.points[index].color, color, t);
-            }
+    // if it doesn't exist, create it
+    if (!thresholds)
+    {
+        // resolution independent scaling
+        float resolutionScale = float(CanvasSizeInPixels(document)) / 1080.0f;
 
-            *pixel = Blend(*pixel, ToPremultipliedAlpha(color));
+        // find the blue noise column for each pixel column once, instead of per pixel
+        std::vector<int> blueNoiseColumns(document.renderSizeX);
+        for (size_t ix = 0; ix < document.renderSizeX; ++ix)
+            blueNoiseColumns[ix] = int(size_t(float(ix) / (scale.X * resolutionScale)) % document.blueNoiseWidth);
 
-            pixel++;
+        // make the scaled, tiled blue noise threshold for every pixel
+        std::vector<uint8_t> newData(document.renderSizeX * document.renderSizeY);
+        for (size_t iy = 0; iy < document.renderSizeY; ++iy)
+        {
+            size_t bny = size_t(float(iy) / (scale.Y * resolutionScale));
+            const Data::ColorU8* blueNoiseRow = &document.blueNoisePixels[(bny % document.blueNoiseHeight) * document.blueNoiseWidth];
+            uint8_t* threshold = &newData[iy * document.renderSizeX];
+            for (size_t ix = 0; ix < document.renderSizeX; ++ix)
+                threshold[ix] = blueNoiseRow[blueNoiseColumns[ix]].R;
         }
-    }
 
-    return true;
+        // store this data in the CAS. It's cheap to remake, so don't write it to disk
+        thresholds = CAS::Set(hash, CAS::KeyClass::DigitalDissolve, newData, true);
+    }
 }
 
 bool EntityDigitalDissolve_Action::DoAction(
@@ -646,84 +1114,179 @@ bool EntityDigitalDissolve_Action::DoAction(
         return true;
     }
 
+    // nothing to draw if both colors are fully transparent
+    bool fgTransparent = digitalDissolve.foreground.A <= 0.0f;
+    bool bgTransparent = digitalDissolve.background.A <= 0.0f;
+    if (fgTransparent && bgTransparent)
+        return true;
+
     // convert colors to PMA
     Data::ColorPMA bg = ToPremultipliedAlpha(digitalDissolve.background);
     Data::ColorPMA fg = ToPremultipliedAlpha(digitalDissolve.foreground);
+    bool fgOpaque = digitalDissolve.foreground.A >= 1.0f;
+    bool bgOpaque = digitalDissolve.background.A >= 1.0f;
 
-    // resolution independent scaling
-    float resolutionScale = float(CanvasSizeInPixels(document)) / 1080.0f;
+    // get the blue noise threshold of every pixel
+    CAS::Handle thresholdData;
+    GetOrMakeDigitalDissolveThresholds(document, digitalDissolve.scale, thresholdData);
+    const uint8_t* thresholds = thresholdData.As<uint8_t>();
 
-    // do blending
+    // A pixel shows the foreground if threshold / 255 <= alpha. Turn that into an integer compare: threshold < alphaCutoff
+    int alphaCutoff = 0;
+    while (alphaCutoff < 256 && float(alphaCutoff) / 255.0f <= digitalDissolve.alpha)
+        alphaCutoff++;
+
+    // do blending, a row at a time.
+    // Opaque colors are written instead of blended, and transparent colors leave the pixel alone.
     for (size_t iy = 0; iy < document.renderSizeY; ++iy)
     {
-        size_t bny = size_t(float(iy) / (digitalDissolve.scale.Y * resolutionScale));
-
         Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX];
-        const Data::ColorU8* blueNoiseRow = &document.blueNoisePixels[(bny % document.blueNoiseHeight) * document.blueNoiseWidth];
-        for (size_t ix = 0; ix < document.renderSizeX; ++ix)
+        const uint8_t* threshold = &thresholds[iy * document.renderSizeX];
+
+        if (fgOpaque && bgOpaque)
         {
-            size_t bnx = size_t(float(ix) / (digitalDissolve.scale.X * resolutionScale));
+            for (size_t ix = 0; ix < document.renderSizeX; ++ix)
+                pixel[ix] = (threshold[ix] < alphaCutoff) ? fg : bg;
+        }
+        else if (fgTransparent || bgTransparent)
+        {
+            const Data::ColorPMA& color = fgTransparent ? bg : fg;
+            bool colorOpaque = fgTransparent ? bgOpaque : fgOpaque;
+            int showForeground = fgTransparent ? 0 : 1;
 
-            float ditherValue = (blueNoiseRow[bnx % document.blueNoiseWidth].R) / 255.0f;
-            
-            if (ditherValue <= digitalDissolve.alpha)
-                *pixel = Blend(*pixel, fg);
-            else
-                *pixel = Blend(*pixel, bg);
+            for (size_t ix = 0; ix < document.renderSizeX; ++ix)
+            {
+                if (int(threshold[ix] < alphaCutoff) != showForeground)
+                    continue;
+                pixel[ix] = colorOpaque ? color : Blend(pixel[ix], color);
+            }
+        }
+        else
+        {
+            for (size_t ix = 0; ix < document.renderSizeX; ++ix)
+                pixel[ix] = Blend(pixel[ix], (threshold[ix] < alphaCutoff) ? fg : bg);
+        }
+    }
 
-            pixel++;
+    return true;
+}
+
+// An image file decoded to linear premultiplied alpha, with a chain of mips that each halve the size of the last.
+struct ImageSource
+{
+    struct Header
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t mipCount = 0;
+    };
+
+    static const int c_maxMips = 32;
+
+    Header header;
+    const Data::ColorPMA* mips[c_maxMips] = {};
+    CAS::Handle data;
+
+    int MipWidth(int mip) const { return GetMipSize(header.width, mip); }
+    int MipHeight(int mip) const { return GetMipSize(header.height, mip); }
+};
+
+// Bump this when the layout of ImageSource in the CAS changes
+static const int c_imageSourceVersion = 1;
+
+static bool GetOrMakeImageSource(const char* filename, ImageSource& imageSource)
+{
+    // try and get the data from the CAS
+    size_t hash = 0;
+    Hash(hash, "ImageSource");
+    Hash(hash, c_imageSourceVersion);
+    Hash(hash, filename);
+    imageSource.data = CAS::Get().Get(hash, CAS::KeyClass::ImageSource);
+
+    // if it doesn't exist, create it
+    if (!imageSource.data)
+    {
+        // load the file
+        int w, h;
+        std::vector<Data::ColorPMA> pixelsPMA;
+        if (!LoadImagePMA(filename, pixelsPMA, w, h))
+        {
+            CAS::Get().CancelMiss(hash);
+            return false;
         }
+
+        // make the mips by shrinking each mip to half size, until it's 1x1
+        ImageSource::Header header;
+        header.width = w;
+        header.height = h;
+        header.mipCount = Min(GetMipCount(w, h), ImageSource::c_maxMips);
+
+        std::vector<Data::ColorPMA> mips;
+        MakeMips(pixelsPMA, w, h, header.mipCount - 1, &mips);
+
+        // put the data into contiguous memory and put it in the CAS.
+        // It's transient because decoded images are large. Only the resized images are written to disk.
+        size_t mipsSize = mips.size() * sizeof(mips[0]);
+        std::vector<unsigned char> newData;
+        newData.resize(sizeof(header) + mipsSize);
+        memcpy(&newData[0], &header, sizeof(header));
+        memcpy(&newData[sizeof(header)], mips.data(), mipsSize);
+        imageSource.data = CAS::Set(hash, CAS::KeyClass::ImageSource, newData, true);
+    }
+
+    // Fill out the data from the CAS
+    const unsigned char* bytes = imageSource.data.As<unsigned char>();
+    memcpy(&imageSource.header, bytes, sizeof(imageSource.header));
+    bytes += sizeof(imageSource.header);
+    for (int mip = 0; mip < (int)imageSource.header.mipCount; ++mip)
+    {
+        imageSource.mips[mip] = (const Data::ColorPMA*)bytes;
+        bytes += imageSource.MipWidth(mip) * imageSource.MipHeight(mip) * sizeof(Data::ColorPMA);
     }
-    
+
     return true;
 }
 
-static bool GetOrMakeImage(const char* filename, int width, int height, const Data::ColorPMA*& data)
+// Bump this when the format of images in the CAS changes
+static const int c_imageVersion = 2;
+
+// Images are stored in the CAS as ColorPMA16 to save memory and disk space
+static bool GetOrMakeImage(const char* filename, int width, int height, CAS::Handle& data)
 {
     // try and get the data from the CAS
     size_t hash = 0;
+    Hash(hash, c_imageVersion);
     Hash(hash, filename);
     Hash(hash, width);
     Hash(hash, height);
-    data = (const Data::ColorPMA*)CAS::Get().Get(hash);
+    data = CAS::Get().Get(hash, CAS::KeyClass::Image);
 
     // if it doesn't exist, create it
     if (!data)
     {
-        // load the file
-        int w, h, channels;
-        stbi_uc* pixels = stbi_load(filename, &w, &h, &channels, 4);
-        if (pixels == nullptr)
+        // get the decoded image, so that making an image at a new size doesn't need to load the file again
+        ImageSource imageSource;
+        if (!GetOrMakeImageSource(filename, imageSource))
         {
-            printf("could not load file %s\n", filename);
+            CAS::Get().CancelMiss(hash);
             return false;
         }
 
-        // convert to PMA
-        std::vector<Data::ColorPMA> pixelsPMA(w * h);
-        const Data::ColorU8* pixel = (Data::ColorU8*)pixels;
-        for (size_t index = 0; index < w * h; ++index)
-        {
-            Data::Color color{ float(pixel->R) / 255.0f, float(pixel->G) / 255.0f, float(pixel->B) / 255.0f, float(pixel->A) / 255.0f };
-            color.R = SRGBToLinear(color.R);
-            color.G = SRGBToLinear(color.G);
-            color.B = SRGBToLinear(color.B);
-            color.A = SRGBToLinear(color.A);
-            pixelsPMA[index] = ToPremultipliedAlpha(color);
-            pixel++;
-        }
+        // Start from the smallest mip that is at least as large as the desired size
+        int mip = ChooseMip(imageSource.header.width, imageSource.header.height, width, height);
+
+        int mipWidth = imageSource.MipWidth(mip);
+        int mipHeight = imageSource.MipHeight(mip);
+        std::vector<Data::ColorPMA> pixelsPMA(imageSource.mips[mip], imageSource.mips[mip] + mipWidth * mipHeight);
 
         // Resize the image to the desired size
-        Resize(pixelsPMA, w, h, width, height);
+        Resize(pixelsPMA, mipWidth, mipHeight, width, height);
 
         // store this data in the CAS
-        CAS::Set(hash, pixelsPMA, false);
-
-        // free the memory
-        stbi_image_free(pixels);
-
-        // Get the data from the CAS now that we have set it
-        data = (const Data::ColorPMA*)CAS::Get().Get(hash);
+        std::vector<ColorPMA16> pixelsPMA16(pixelsPMA.size());
+        for (size_t index = 0; index < pixelsPMA.size(); ++index)
+            pixelsPMA16[index] = ToColorPMA16(pixelsPMA[index]);
+        data = CAS::Set(hash, CAS::KeyClass::Image, pixelsPMA16, false, true);
     }
     return true;
 }
@@ -745,8 +1308,10 @@ bool EntityImage_Action::DoAction(
     // Get the image
     int desiredWidth = pixelMaxX - pixelMinX;
     int desiredHeight = pixelMaxY - pixelMinY;
-    const Data::ColorPMA* srcPixels = nullptr;
-    GetOrMakeImage(image.fileName.c_str(), desiredWidth, desiredHeight, srcPixels);
+    CAS::Handle srcData;
+    if (!GetOrMakeImage(image.fileName.c_str(), desiredWidth, desiredHeight, srcData))
+        return true;
+    const ColorPMA16* srcPixels = srcData.As<ColorPMA16>();
 
     // clip the image to the screen
     int srcOffsetX = 0;
@@ -765,16 +1330,35 @@ bool EntityImage_Action::DoAction(
     for (size_t iy = pixelMinY; iy < pixelMaxY; ++iy)
     {
         Data::ColorPMA* destPixel = &pixels[iy * document.renderSizeX + pixelMinX];
-        const Data::ColorPMA* srcPixel = &srcPixels[(iy - pixelMinY + srcOffsetY) * desiredWidth + srcOffsetX];
+        const ColorPMA16* srcPixel = &srcPixels[(iy - pixelMinY + srcOffsetY) * desiredWidth + srcOffsetX];
+        BlendRow(destPixel, srcPixel, pixelMaxX - pixelMinX, tint);
+    }
 
-        for (size_t ix = pixelMinX; ix < pixelMaxX; ++ix)
-        {
-            *destPixel = Blend(*destPixel, *srcPixel * tint);
-            srcPixel++;
-            destPixel++;
-        }
+    return true;
+}
+
+bool EntityFlipbook_Action::Initialize(const Data::Document& document, Data::Entity& entity, int entityIndex)
+{
+    Data::EntityFlipbook& flipbook = entity.data.flipbook;
+    if (flipbook.videoFile.empty())
+        return true;
+
+    // counting the frames means decoding the whole video, so remember it for this run
+    size_t hash = 0;
+    Hash(hash, "VideoFrameCount");
+    Hash(hash, flipbook.videoFile.c_str());
+    CAS::Handle frameCount = CAS::Get().Get(hash, CAS::KeyClass::VideoFrameCount);
+    if (!frameCount)
+    {
+        int newFrameCount = FlipbookStreams::GetVideoFrameCount(document.config.ffmpeg, flipbook.videoFile);
+        frameCount = CAS::Set(hash, CAS::KeyClass::VideoFrameCount, newFrameCount, true);
     }
 
+    // Note: don't return false if the video can't be read. We want to just not show it.
+    flipbook.videoFrameCount = *frameCount.As<int>();
+    if (flipbook.videoFrameCount == 0)
+        printf("could not read frames from video %s\n", flipbook.videoFile.c_str());
+
     return true;
 }
 
@@ -793,11 +1377,14 @@ bool EntityFlipbook_Action::DoAction(
     GetPixelBoundingBox_PointRadius(document, flipbook.position.X, flipbook.position.Y, flipbook.radius.X, flipbook.radius.Y, pixelMinX, pixelMinY, pixelMaxX, pixelMaxY);
 
     // Get the image we are using this frame
+    // The images are streamed instead of cached in the CAS, so long flipbooks don't need all of their images in memory
     int imageIndex = GetImageIndex(document, entity, context);
     int desiredWidth = pixelMaxX - pixelMinX;
     int desiredHeight = pixelMaxY - pixelMinY;
-    const Data::ColorPMA* srcPixels = nullptr;
-    GetOrMakeImage(flipbook.fileNames[imageIndex].c_str(), desiredWidth, desiredHeight, srcPixels);
+    std::shared_ptr<const FlipbookImage> image = FlipbookStreams::Get().GetImage(document, flipbook, imageIndex, desiredWidth, desiredHeight);
+    if (!image)
+        return true;
+    const ColorPMA16* srcPixels = image->pixels.data();
 
     // clip the image to the screen
     int srcOffsetX = 0;
@@ -816,14 +1403,8 @@ bool EntityFlipbook_Action::DoAction(
     for (size_t iy = pixelMinY; iy < pixelMaxY; ++iy)
     {
         Data::ColorPMA* destPixel = &pixels[iy * document.renderSizeX + pixelMinX];
-        const Data::ColorPMA* srcPixel = &srcPixels[(iy - pixelMinY + srcOffsetY) * desiredWidth + srcOffsetX];
-
-        for (size_t ix = pixelMinX; ix < pixelMaxX; ++ix)
-        {
-            *destPixel = Blend(*destPixel, *srcPixel * tint);
-            srcPixel++;
-            destPixel++;
-        }
+        const ColorPMA16* srcPixel = &srcPixels[(iy - pixelMinY + srcOffsetY) * desiredWidth + srcOffsetX];
+        BlendRow(destPixel, srcPixel, pixelMaxX - pixelMinX, tint);
     }
 
     return true;
@@ -837,14 +1418,38 @@ struct CubicBezierData
         float x, y;
     };
 
-    uint32_t pointCount = 0;
-    CurvePoint* points = nullptr;
+    // The curve points are in t order, so segment i goes from points[i] to points[i+1].
+    // The segments are put into a uniform grid in pixel space, so that finding the segments near a pixel
+    // only looks at the part of the curve that is near the pixel, no matter how the curve is oriented.
+    struct Header
+    {
+        uint32_t pointCount = 0;
+        uint32_t gridCellsX = 0;
+        uint32_t gridCellsY = 0;
+        float gridMinX = 0.0f;
+        float gridMinY = 0.0f;
+        float gridCellSize = 1.0f;
+    };
+
+    Header header;
+    const CurvePoint* points = nullptr;
+    const uint32_t* gridCellStarts = nullptr;    // gridCellsX * gridCellsY + 1 offsets into gridCellSegments
+    const uint32_t* gridCellSegments = nullptr;  // the segment indices in each grid cell
+    CAS::Handle data;
 };
 
+// Bump this when the layout of CubicBezierData in the CAS changes, or how it is made changes
+static const int c_cubicBezierDataVersion = 3;
+
 static void GetOrMakeCubicBezierData(const Data::Document& document, const Data::EntityCubicBezier& cubicBezier, CubicBezierData& cubicBezierData)
 {
+    // The smallest grid cell size in pixels, and the most grid cells to make
+    static const float c_minGridCellSize = 8.0f;
+    static const float c_maxGridCells = 65536.0f;
+
     // hash the input
     size_t hash = 0;
+    Hash(hash, c_cubicBezierDataVersion);
     Hash(hash, document.renderSizeX);
     Hash(hash, document.renderSizeY);
     Hash(hash, cubicBezier.A);
@@ -858,12 +1463,19 @@ static void GetOrMakeCubicBezierData(const Data::Document& document, const Data:
     const Data::Point3D& D = cubicBezier.D;
 
     // if the data isn't already in the CAS make it and then put it in
-    void* data = CAS::Get().Get(hash);
-    if (!data)
+    cubicBezierData.data = CAS::Get().Get(hash, CAS::KeyClass::CubicBezier);
+    if (!cubicBezierData.data)
     {
-        // first we want to turn the curve into a bunch of line segments which are no more than 1 pixel long
-        std::vector<CubicBezierData::CurvePoint> points;
-        auto InsertCurvePoint = [&](float t)
+        // Turn the curve into line segments with adaptive subdivision. A span of the curve is split in half until
+        // the middle of the span is within c_flatnessTolerance pixels of the line segment between its end points.
+        // Every span is split c_minSubdivisionDepth times first, so that an S shaped span which happens to have its
+        // middle point on the line segment isn't mistaken as flat.
+        // A stack is used so that points come out in t order, making the cost linear in the number of points.
+        static const float c_flatnessTolerance = 0.1f;
+        static const int c_minSubdivisionDepth = 4;
+        static const int c_maxSubdivisionDepth = 24;
+
+        auto EvaluateCurvePoint = [&](float t)
         {
             float cz = CubicBezierInterpolation(A.Z, B.Z, C.Z, D.Z, t);
 
@@ -873,50 +1485,215 @@ static void GetOrMakeCubicBezierData(const Data::Document& document, const Data:
             float cy = CubicBezierInterpolation(A.Y * A.Z, B.Y * B.Z, C.Y * C.Z, D.Y * D.Z, t);
             cy /= cz;
 
-            float px, py;
-            CanvasToPixelFloat(document, cx, cy, px, py);
+            CubicBezierData::CurvePoint ret;
+            ret.t = t;
+            CanvasToPixelFloat(document, cx, cy, ret.x, ret.y);
+            return ret;
+        };
 
-            points.push_back({ t, px, py });
-            std::sort(points.begin(), points.end(), [](const CubicBezierData::CurvePoint& A, const CubicBezierData::CurvePoint& B) { return A.t < B.t; });
+        struct CurveSpan
+        {
+            CubicBezierData::CurvePoint start;
+            CubicBezierData::CurvePoint end;
+            int depth;
         };
-        InsertCurvePoint(0.0f);
-        InsertCurvePoint(1.0f);
-        int index = 0;
-        while (index + 1 < points.size())
+
+        std::vector<CubicBezierData::CurvePoint> points;
+        std::vector<CurveSpan> stack;
+        points.push_back(EvaluateCurvePoint(0.0f));
+        stack.push_back({ points[0], EvaluateCurvePoint(1.0f), 0 });
+        while (!stack.empty())
         {
-            vec2 a = vec2{ points[index].x, points[index].y };
-            vec2 b = vec2{ points[index + 1].x, points[index + 1].y };
+            CurveSpan span = stack.back();
+            stack.pop_back();
 
-            float length = Length(b - a);
-            if (length > 1.0f)
+            CubicBezierData::CurvePoint middle = EvaluateCurvePoint((span.start.t + span.end.t) / 2.0f);
+
+            bool split = span.depth < c_minSubdivisionDepth;
+            if (!split && span.depth < c_maxSubdivisionDepth)
+            {
+                float distanceSquared = sdLineSquared(vec2{ span.start.x, span.start.y }, vec2{ span.end.x, span.end.y }, vec2{ middle.x, middle.y });
+                split = distanceSquared > c_flatnessTolerance * c_flatnessTolerance;
+            }
+
+            // push the second half first, so the first half is processed first
+            if (split)
             {
-                InsertCurvePoint((points[index].t + points[index + 1].t) / 2.0f);
+                stack.push_back({ middle, span.end, span.depth + 1 });
+                stack.push_back({ span.start, middle, span.depth + 1 });
             }
             else
             {
-                index++;
+                points.push_back(span.end);
             }
         }
 
-        // Now sort the points by x coordinate, so that we can do dimensional reduction and only test the points near our point on one axis
-        std::sort(points.begin(), points.end(), [](const CubicBezierData::CurvePoint& A, const CubicBezierData::CurvePoint& B) { return A.x < B.x; });
+        // size the grid to cover the bounding box of the curve
+        CubicBezierData::Header header;
+        header.pointCount = (uint32_t)points.size();
+        float maxX = points[0].x;
+        float maxY = points[0].y;
+        header.gridMinX = points[0].x;
+        header.gridMinY = points[0].y;
+        for (const CubicBezierData::CurvePoint& point : points)
+        {
+            header.gridMinX = Min(header.gridMinX, point.x);
+            header.gridMinY = Min(header.gridMinY, point.y);
+            maxX = Max(maxX, point.x);
+            maxY = Max(maxY, point.y);
+        }
+        float sizeX = maxX - header.gridMinX;
+        float sizeY = maxY - header.gridMinY;
+        header.gridCellSize = Max(c_minGridCellSize, (float)sqrt(sizeX * sizeY / c_maxGridCells), Max(sizeX, sizeY) / c_maxGridCells);
+        header.gridCellsX = uint32_t(sizeX / header.gridCellSize) + 1;
+        header.gridCellsY = uint32_t(sizeY / header.gridCellSize) + 1;
+
+        // put each segment into every grid cell that its bounding box touches.
+        // Count how many segments are in each cell first, then fill them in.
+        auto GetSegmentCells = [&](uint32_t segmentIndex, uint32_t& minCellX, uint32_t& minCellY, uint32_t& maxCellX, uint32_t& maxCellY)
+        {
+            const CubicBezierData::CurvePoint& p0 = points[segmentIndex];
+            const CubicBezierData::CurvePoint& p1 = points[segmentIndex + 1];
+            minCellX = Min(uint32_t((Min(p0.x, p1.x) - header.gridMinX) / header.gridCellSize), header.gridCellsX - 1);
+            minCellY = Min(uint32_t((Min(p0.y, p1.y) - header.gridMinY) / header.gridCellSize), header.gridCellsY - 1);
+            maxCellX = Min(uint32_t((Max(p0.x, p1.x) - header.gridMinX) / header.gridCellSize), header.gridCellsX - 1);
+            maxCellY = Min(uint32_t((Max(p0.y, p1.y) - header.gridMinY) / header.gridCellSize), header.gridCellsY - 1);
+        };
+
+        uint32_t segmentCount = header.pointCount - 1;
+        std::vector<uint32_t> gridCellStarts(header.gridCellsX * header.gridCellsY + 1, 0);
+        for (uint32_t segmentIndex = 0; segmentIndex < segmentCount; ++segmentIndex)
+        {
+            uint32_t minCellX, minCellY, maxCellX, maxCellY;
+            GetSegmentCells(segmentIndex, minCellX, minCellY, maxCellX, maxCellY);
+            for (uint32_t cellY = minCellY; cellY <= maxCellY; ++cellY)
+                for (uint32_t cellX = minCellX; cellX <= maxCellX; ++cellX)
+                    gridCellStarts[cellY * header.gridCellsX + cellX + 1]++;
+        }
+        for (size_t cellIndex = 1; cellIndex < gridCellStarts.size(); ++cellIndex)
+            gridCellStarts[cellIndex] += gridCellStarts[cellIndex - 1];
+
+        std::vector<uint32_t> gridCellSegments(gridCellStarts.back());
+        std::vector<uint32_t> gridCellFill(gridCellStarts.begin(), gridCellStarts.end() - 1);
+        for (uint32_t segmentIndex = 0; segmentIndex < segmentCount; ++segmentIndex)
+        {
+            uint32_t minCellX, minCellY, maxCellX, maxCellY;
+            GetSegmentCells(segmentIndex, minCellX, minCellY, maxCellX, maxCellY);
+            for (uint32_t cellY = minCellY; cellY <= maxCellY; ++cellY)
+                for (uint32_t cellX = minCellX; cellX <= maxCellX; ++cellX)
+                    gridCellSegments[gridCellFill[cellY * header.gridCellsX + cellX]++] = segmentIndex;
+        }
 
         // put the data into contiguous memory and put it in the CAS
+        size_t pointsSize = points.size() * sizeof(points[0]);
+        size_t gridCellStartsSize = gridCellStarts.size() * sizeof(gridCellStarts[0]);
+        size_t gridCellSegmentsSize = gridCellSegments.size() * sizeof(gridCellSegments[0]);
         std::vector<unsigned char> newData;
-        newData.resize(sizeof(uint32_t) + points.size() * sizeof(points[0]));
-        *((uint32_t*)&newData[0]) = (uint32_t)points.size();
-        memcpy(&newData[sizeof(uint32_t)], points.data(), points.size() * sizeof(points[0]));
+        newData.resize(sizeof(header) + pointsSize + gridCellStartsSize + gridCellSegmentsSize);
+        memcpy(&newData[0], &header, sizeof(header));
+        memcpy(&newData[sizeof(header)], points.data(), pointsSize);
+        memcpy(&newData[sizeof(header) + pointsSize], gridCellStarts.data(), gridCellStartsSize);
+        if (gridCellSegmentsSize > 0)
+            memcpy(&newData[sizeof(header) + pointsSize + gridCellStartsSize], gridCellSegments.data(), gridCellSegmentsSize);
 
         // set the data
-        CAS::Set(hash, newData, false);
-
-        // get the data
-        data = CAS::Get().Get(hash);
+        cubicBezierData.data = CAS::Set(hash, CAS::KeyClass::CubicBezier, newData, false, true);
     }
 
     // Fill out the data from the CAS
-    cubicBezierData.pointCount = ((uint32_t*)data)[0];
-    cubicBezierData.points = (CubicBezierData::CurvePoint*) &((unsigned char*)data)[sizeof(uint32_t)];
+    const unsigned char* bytes = cubicBezierData.data.As<unsigned char>();
+    memcpy(&cubicBezierData.header, bytes, sizeof(cubicBezierData.header));
+    bytes += sizeof(cubicBezierData.header);
+    cubicBezierData.points = (const CubicBezierData::CurvePoint*)bytes;
+    bytes += cubicBezierData.header.pointCount * sizeof(CubicBezierData::CurvePoint);
+    cubicBezierData.gridCellStarts = (const uint32_t*)bytes;
+    bytes += (cubicBezierData.header.gridCellsX * cubicBezierData.header.gridCellsY + 1) * sizeof(uint32_t);
+    cubicBezierData.gridCellSegments = (const uint32_t*)bytes;
+}
+
+// Draws the curve, with the sample loop specialized for the sample count. See DISPATCH_SAMPLE_COUNT.
+template <uint32_t SAMPLE_COUNT>
+static void DrawCubicBezier(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, int minPixelX, int minPixelY, int maxPixelX, int maxPixelY, const CubicBezierData& cubicBezierData, const Data::Point2D& offsetPx, float curveWidth, const Data::ColorPMA& colorPMA)
+{
+    JitterSamples<SAMPLE_COUNT> jitter(document);
+    const CubicBezierData::Header& grid = cubicBezierData.header;
+    float curveWidthSquared = curveWidth * curveWidth;
+
+    // A segment is in every grid cell its bounding box touches, so it can be found in more than one of the cells near
+    // a pixel. Each segment remembers the last pixel it was gathered for, so it's only tested once per sample.
+    std::vector<uint32_t> candidateSegments;
+    std::vector<uint32_t> segmentLastPixel(grid.pointCount, 0);
+    uint32_t pixelNumber = 0;
+    for (int iy = minPixelY; iy <= maxPixelY; ++iy)
+    {
+        Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX + minPixelX];
+        for (int ix = minPixelX; ix <= maxPixelX; ++ix, ++pixel)
+        {
+            // gather the segments in the grid cells that are within the curve width of this pixel
+            float pixelMinX = float(ix) - offsetPx.X - curveWidth - grid.gridMinX;
+            float pixelMinY = float(iy) - offsetPx.Y - curveWidth - grid.gridMinY;
+            float pixelMaxX = float(ix + 1) - offsetPx.X + curveWidth - grid.gridMinX;
+            float pixelMaxY = float(iy + 1) - offsetPx.Y + curveWidth - grid.gridMinY;
+            if (pixelMaxX < 0.0f || pixelMaxY < 0.0f || pixelMinX >= float(grid.gridCellsX) * grid.gridCellSize || pixelMinY >= float(grid.gridCellsY) * grid.gridCellSize)
+                continue;
+
+            uint32_t minCellX = uint32_t(Max(pixelMinX, 0.0f) / grid.gridCellSize);
+            uint32_t minCellY = uint32_t(Max(pixelMinY, 0.0f) / grid.gridCellSize);
+            uint32_t maxCellX = Min(uint32_t(pixelMaxX / grid.gridCellSize), grid.gridCellsX - 1);
+            uint32_t maxCellY = Min(uint32_t(pixelMaxY / grid.gridCellSize), grid.gridCellsY - 1);
+
+            candidateSegments.clear();
+            pixelNumber++;
+            for (uint32_t cellY = minCellY; cellY <= maxCellY; ++cellY)
+            {
+                for (uint32_t cellX = minCellX; cellX <= maxCellX; ++cellX)
+                {
+                    uint32_t cellIndex = cellY * grid.gridCellsX + cellX;
+                    for (uint32_t segment = cubicBezierData.gridCellStarts[cellIndex]; segment < cubicBezierData.gridCellStarts[cellIndex + 1]; ++segment)
+                    {
+                        uint32_t segmentIndex = cubicBezierData.gridCellSegments[segment];
+                        if (segmentLastPixel[segmentIndex] != pixelNumber)
+                        {
+                            segmentLastPixel[segmentIndex] = pixelNumber;
+                            candidateSegments.push_back(segmentIndex);
+                        }
+                    }
+                }
+            }
+
+            // if no part of the curve is near this pixel, there is nothing to draw
+            if (candidateSegments.empty())
+                continue;
+
+            // do multiple jittered samples per pixel and integrate (average) the result
+            Data::ColorPMA samplesColor;
+            Data::Point2D jitterRotation = GetJitterRotation(document, ix, iy);
+            for (uint32_t sampleIndex = 0; sampleIndex < jitter.Count(); ++sampleIndex)
+            {
+                Data::Point2D offset = GetJitterOffset(jitter.points[sampleIndex], jitterRotation);
+
+                vec2 samplePos = vec2{ ix + offset.X - offsetPx.X, iy + offset.Y - offsetPx.Y };
+
+                // the sample is covered if any segment is close enough, so stop looking once one is found
+                for (uint32_t segmentIndex : candidateSegments)
+                {
+                    const CubicBezierData::CurvePoint& p0 = cubicBezierData.points[segmentIndex];
+                    const CubicBezierData::CurvePoint& p1 = cubicBezierData.points[segmentIndex + 1];
+
+                    if (sdLineSquared(vec2{ p0.x, p0.y }, vec2{ p1.x, p1.y }, samplePos) < curveWidthSquared)
+                    {
+                        samplesColor.R += colorPMA.R / float(jitter.Count());
+                        samplesColor.G += colorPMA.G / float(jitter.Count());
+                        samplesColor.B += colorPMA.B / float(jitter.Count());
+                        samplesColor.A += colorPMA.A / float(jitter.Count());
+                        break;
+                    }
+                }
+            }
+
+            *pixel = Blend(*pixel, samplesColor);
+        }
+    }
 }
 
 bool EntityCubicBezier_Action::DoAction(
@@ -937,6 +1714,7 @@ bool EntityCubicBezier_Action::DoAction(
     // get or make the cached bezier data (expensive to calculate each frame)
     CubicBezierData cubicBezierData;
     GetOrMakeCubicBezierData(document, cubicBezier, cubicBezierData);
+    const CubicBezierData::Header& grid = cubicBezierData.header;
 
     Data::Point3D A = ToPoint3D(offsetCanvas) + cubicBezier.A;
     Data::Point3D B = ToPoint3D(offsetCanvas) + cubicBezier.B;
@@ -964,59 +1742,7 @@ bool EntityCubicBezier_Action::DoAction(
     float curveWidth = CanvasLengthToPixelLength(document, cubicBezier.width);
 
     // Draw it
-    for (int iy = minPixelY; iy <= maxPixelY; ++iy)
-    {
-        Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX + minPixelX];
-        for (int ix = minPixelX; ix <= maxPixelX; ++ix)
-        {
-            // do multiple jittered samples per pixel and integrate (average) the result
-            Data::ColorPMA samplesColor;
-            for (uint32_t sampleIndex = 0; sampleIndex < document.samplesPerPixel; ++sampleIndex)
-            {
-                Data::Point2D offset = document.jitterSequence.points[sampleIndex];
-
-                float pixelX = ix + offset.X - offsetPx.X;
-                float pixelY = iy + offset.Y - offsetPx.Y;
-
-                // binary search to find where to start the scan from
-                auto it = std::upper_bound(cubicBezierData.points, &cubicBezierData.points[cubicBezierData.pointCount], pixelX,
-                    [] (const float pixelX, const CubicBezierData::CurvePoint& curvePoint)
-                    {
-                        return pixelX < curvePoint.x;
-                    }
-                );
-                uint32_t startIndex = (uint32_t)(it - cubicBezierData.points);
-
-                // since the points of the curve are dense, we can find the distance to the closest point instead of line segments
-                float closestDistanceSquared = FLT_MAX;
-                for (uint32_t pointIndex = startIndex; pointIndex < cubicBezierData.pointCount; ++pointIndex)
-                {
-                   const CubicBezierData::CurvePoint& p = cubicBezierData.points[pointIndex];
-
-                    if (p.x < floor(pixelX - curveWidth))
-                        continue;
-
-                    if (p.x > ceil(pixelX + curveWidth))
-                        break;
-
-                    float distanceSquared = LengthSquared(vec2{ p.x, p.y } - vec2{ pixelX, pixelY });
-                    closestDistanceSquared = Min(closestDistanceSquared, distanceSquared);
-                }
-
-                if ((float)sqrt(closestDistanceSquared) < curveWidth)
-                {
-                    samplesColor.R += colorPMA.R / float(document.samplesPerPixel);
-                    samplesColor.G += colorPMA.G / float(document.samplesPerPixel);
-                    samplesColor.B += colorPMA.B / float(document.samplesPerPixel);
-                    samplesColor.A += colorPMA.A / float(document.samplesPerPixel);
-                }
-            }
-
-            *pixel = Blend(*pixel, samplesColor);
-
-            pixel++;
-        }
-    }
+    DISPATCH_SAMPLE_COUNT(document, DrawCubicBezier, document, pixels, minPixelX, minPixelY, maxPixelX, maxPixelY, cubicBezierData, offsetPx, curveWidth, colorPMA);
 
     return true;
 }
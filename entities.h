@@ -3,15 +3,27 @@
 #include "utils.h"
 #include "animatron.h"
 
+#include <map>
+
 inline Data::Point3D GetParentPosition(
     const Data::Document& document,
     const std::unordered_map<std::string, Data::Entity>& entityMap,
     const Data::Entity& entity);
 
+struct WorldViewProjection
+{
+    Data::Matrix4x4 mtx;
+    bool perspective = true;
+};
+
 struct EntityActionFrameContext
 {
     int frameIndex = 0;
     float frameTime = 0.0f;
+
+    // The combined transform and camera matrix for each (camera, transform) pair used this frame, so that 3d entities
+    // sharing a camera and transform only make it once. Mutable since entity actions are given a const context.
+    mutable std::map<std::pair<std::string, std::string>, WorldViewProjection> worldViewProjections;
 };
 
 // Default base class functionality
@@ -50,6 +62,14 @@ struct EntityActionBase
     {
     }
 
+    // Return true if the entity can look different at different times even when its keyframes
+    // don't change it. This is usually the case when ExtraFrameHash is implemented.
+    // The static frame analysis uses this to know that it can't skip frames while the entity exists.
+    static bool HasTimeDependentState(const Data::Entity& entity)
+    {
+        return false;
+    }
+
 
     // Required implementation
 
@@ -182,6 +202,10 @@ struct EntityTransform_Action : EntityActionBase
     }
 };
 
+// Makes the latex images used by the document's entities and keyframes that aren't already in the CAS, running several
+// latex jobs at once. Done at load so that rendering doesn't stall on latex.
+void PrefetchLatexImages(const Data::Document& document);
+
 struct EntityLatex_Action : EntityActionBase
 {
     static bool DoAction(
@@ -238,6 +262,8 @@ struct EntityImage_Action : EntityActionBase
 
 struct EntityFlipbook_Action : EntityActionBase
 {
+    static bool Initialize(const Data::Document& document, Data::Entity& entity, int entityIndex);
+
     static bool DoAction(
         const Data::Document& document,
         const std::unordered_map<std::string, Data::Entity>& entityMap,
@@ -248,9 +274,17 @@ struct EntityFlipbook_Action : EntityActionBase
 
     static Data::Point3D GetPosition(const Data::Entity& entity) { return ToPoint3D(entity.data.image.position); }
 
+    static int GetImageCount(const Data::EntityFlipbook& flipbook)
+    {
+        return flipbook.videoFile.empty() ? (int)flipbook.fileNames.size() : flipbook.videoFrameCount;
+    }
+
     static int GetImageIndex(const Data::Document& document, const Data::Entity& entity, const EntityActionFrameContext& context)
     {
         const Data::EntityFlipbook& flipbook = entity.data.flipbook;
+        int imageCount = GetImageCount(flipbook);
+        if (imageCount == 0)
+            return 0;
 
         int imageIndex = 0;
         if (flipbook.timePerFrame > 0.0f)
@@ -259,9 +293,9 @@ struct EntityFlipbook_Action : EntityActionBase
             imageIndex = Max(0, context.frameIndex - SecondsToFrameIndex(document, entity.createTime));
 
         if (flipbook.loop)
-            imageIndex = imageIndex % (int)flipbook.fileNames.size();
+            imageIndex = imageIndex % imageCount;
         else
-            imageIndex = Min(imageIndex, (int)flipbook.fileNames.size() - 1);
+            imageIndex = Min(imageIndex, imageCount - 1);
 
         return imageIndex;
     }
@@ -271,6 +305,11 @@ struct EntityFlipbook_Action : EntityActionBase
         int imageIndex = GetImageIndex(document, entity, context);
         Hash(hash, imageIndex);
     }
+
+    static bool HasTimeDependentState(const Data::Entity& entity)
+    {
+        return GetImageCount(entity.data.flipbook) > 1;
+    }
 };
 
 struct EntityCubicBezier_Action : EntityActionBase
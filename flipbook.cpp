@@ -0,0 +1,441 @@
+#include "flipbook.h"
+#include "schemas/hash.h"
+#include <omp.h>
+#include <cstring>
+#include <cstdlib>
+
+// How many images after the playhead to decode ahead of time
+static const int c_imagesAhead = 16;
+
+// A stream that hasn't been used in this many requests (from any stream) is freed
+static const uint64_t c_maxIdleUses = 4096;
+
+// Render threads work on different frames at the same time, so requests come in a little out of order.
+// Images this far behind the playhead are kept for the threads that are behind, and a request this far behind the
+// playhead doesn't move the playhead back, since that isn't a seek.
+static int ImagesBehind()
+{
+    return omp_get_max_threads() + 2;
+}
+
+FlipbookStreams::~FlipbookStreams()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_jobAdded.notify_all();
+
+    for (std::thread& worker : m_workers)
+        worker.join();
+
+    for (auto& pair : m_streams)
+    {
+        if (pair.second.videoPipe)
+            CloseProcessPipe(pair.second.videoPipe);
+    }
+}
+
+// Reads the header that ffmpeg writes before each PAM image, which gives the size of the frame
+static bool ReadPAMHeader(FILE* pipe, int& width, int& height)
+{
+    char line[256];
+    while (fgets(line, sizeof(line), pipe))
+    {
+        if (strncmp(line, "WIDTH ", 6) == 0)
+            width = atoi(&line[6]);
+        else if (strncmp(line, "HEIGHT ", 7) == 0)
+            height = atoi(&line[7]);
+        else if (strncmp(line, "ENDHDR", 6) == 0)
+            return width > 0 && height > 0;
+    }
+    return false;
+}
+
+int FlipbookStreams::GetVideoFrameCount(const std::string& ffmpeg, const std::string& videoFile)
+{
+    // Have ffmpeg decode the video to nowhere, and report the progress to stdout. The last frame= line is the frame count.
+    // The frames are decoded the same way that DecodeVideoFrames decodes them, so that edit lists, frames that fail to
+    // decode and variable frame rates give the same count. Counting packets without decoding them is faster, but can
+    // give a count that doesn't match the frames the pipe gives.
+    FILE* pipe = OpenProcessPipe(ffmpeg, { "-nostdin", "-v", "error", "-i", videoFile, "-map", "0:v:0", "-pix_fmt", "rgba", "-f", "null", "-progress", "pipe:1", "-" });
+    if (!pipe)
+        return 0;
+
+    int frameCount = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), pipe))
+    {
+        if (strncmp(line, "frame=", 6) == 0)
+            frameCount = atoi(&line[6]);
+    }
+
+    CloseProcessPipe(pipe);
+    return frameCount;
+}
+
+bool FlipbookStreams::DecodeImage(const std::string& fileName, int width, int height, FlipbookImage& image)
+{
+    int w, h;
+    std::vector<Data::ColorPMA> pixelsPMA;
+    if (!LoadImagePMA(fileName.c_str(), pixelsPMA, w, h))
+        return false;
+
+    ShrinkToMip(pixelsPMA, w, h, width, height, image);
+    return true;
+}
+
+void FlipbookStreams::ShrinkToMip(std::vector<Data::ColorPMA>& pixels, int sourceWidth, int sourceHeight, int width, int height, FlipbookImage& image)
+{
+    // only the one mip that will be resized from is kept, not the full chain, so the memory used follows the size the
+    // image is drawn at, not the size of the source
+    int mip = ChooseMip(sourceWidth, sourceHeight, width, height);
+    MakeMips(pixels, sourceWidth, sourceHeight, mip, nullptr);
+
+    image.width = GetMipSize(sourceWidth, mip);
+    image.height = GetMipSize(sourceHeight, mip);
+    image.pixels.resize(pixels.size());
+    for (size_t index = 0; index < pixels.size(); ++index)
+        image.pixels[index] = ToColorPMA16(pixels[index]);
+}
+
+std::shared_ptr<const FlipbookImage> FlipbookStreams::ResizeDecoded(const FlipbookImage& decoded, int width, int height)
+{
+    // If the size grew since the image was decoded, this grows the decoded mip rather than decoding it again
+    std::vector<Data::ColorPMA> pixelsPMA(decoded.pixels.size());
+    for (size_t index = 0; index < pixelsPMA.size(); ++index)
+        pixelsPMA[index] = FromColorPMA16(decoded.pixels[index]);
+
+    Resize(pixelsPMA, decoded.width, decoded.height, width, height);
+
+    std::shared_ptr<FlipbookImage> image = std::make_shared<FlipbookImage>();
+    image->width = width;
+    image->height = height;
+    image->pixels.resize(pixelsPMA.size());
+    for (size_t index = 0; index < pixelsPMA.size(); ++index)
+        image->pixels[index] = ToColorPMA16(pixelsPMA[index]);
+    return image;
+}
+
+int FlipbookStreams::DistanceFromPlayhead(const Stream& stream, int imageIndex) const
+{
+    int distance = imageIndex - stream.playhead;
+
+    // looping flipbooks are circular, so take the shorter way around
+    if (stream.loop)
+    {
+        distance = ((distance % stream.imageCount) + stream.imageCount) % stream.imageCount;
+        if (distance > stream.imageCount / 2)
+            distance -= stream.imageCount;
+    }
+
+    return distance;
+}
+
+void FlipbookStreams::MovePlayhead(size_t streamKey, Stream& stream, int imageIndex)
+{
+    int imagesBehind = ImagesBehind();
+
+    // move the playhead forward, or back if it's a seek
+    int distance = DistanceFromPlayhead(stream, imageIndex);
+    if (distance > 0 || distance < -imagesBehind)
+        stream.playhead = imageIndex;
+
+    // free the images outside of the window. Images being loaded are left alone, the loader needs the slot.
+    for (auto it = stream.slots.begin(); it != stream.slots.end();)
+    {
+        int slotDistance = DistanceFromPlayhead(stream, it->first);
+        if (!it->second.loading && (slotDistance < -imagesBehind || slotDistance > c_imagesAhead))
+            it = stream.slots.erase(it);
+        else
+            ++it;
+    }
+
+    // queue up the images after the playhead that aren't loaded yet
+    for (int ahead = 1; ahead <= c_imagesAhead; ++ahead)
+    {
+        int aheadIndex = stream.playhead + ahead;
+        if (stream.loop)
+            aheadIndex = aheadIndex % stream.imageCount;
+        else if (aheadIndex >= stream.imageCount)
+            break;
+
+        if (stream.slots.count(aheadIndex) > 0)
+            continue;
+
+        stream.slots[aheadIndex].loading = true;
+        m_jobs.push_back({ streamKey, aheadIndex });
+        m_jobAdded.notify_one();
+    }
+}
+
+void FlipbookStreams::RemoveIdleStreams()
+{
+    for (auto it = m_streams.begin(); it != m_streams.end();)
+    {
+        bool loading = it->second.videoDecoding;
+        for (const auto& pair : it->second.slots)
+            loading |= pair.second.loading;
+
+        if (!loading && it->second.lastUse + c_maxIdleUses < m_useCount)
+        {
+            if (it->second.videoPipe)
+                CloseProcessPipe(it->second.videoPipe);
+            it = m_streams.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void FlipbookStreams::DecodeVideoFrames(size_t streamKey, std::unique_lock<std::mutex>& lock)
+{
+    // if another thread is reading the video, it will get to the frames this thread wants
+    if (m_streams[streamKey].videoDecoding)
+        return;
+    m_streams[streamKey].videoDecoding = true;
+
+    // The stream isn't removed while videoDecoding is set, so it's safe to look it up again after unlocking
+    std::vector<Data::ColorU8> frameU8;
+    while (true)
+    {
+        Stream& stream = m_streams[streamKey];
+
+        // find the next frame that is waiting to load. Frames are read in order, so if the only frames waiting are
+        // before the pipe's position, the video has to be started again from the beginning.
+        int nextWantedFrame = -1;
+        bool wantsEarlierFrame = false;
+        for (const auto& pair : stream.slots)
+        {
+            if (!pair.second.loading)
+                continue;
+
+            if (pair.first >= stream.videoNextFrame)
+                nextWantedFrame = (nextWantedFrame < 0) ? pair.first : Min(nextWantedFrame, pair.first);
+            else
+                wantsEarlierFrame = true;
+        }
+
+        if (nextWantedFrame < 0 && !wantsEarlierFrame)
+            break;
+
+        if (nextWantedFrame < 0 && stream.videoPipe)
+        {
+            CloseProcessPipe(stream.videoPipe);
+            stream.videoPipe = nullptr;
+        }
+
+        if (!stream.videoPipe)
+        {
+            // have ffmpeg decode the video at its own size as rgba PAM images, which have a header giving the size
+            stream.videoPipe = OpenProcessPipe(stream.ffmpeg, { "-nostdin", "-v", "error", "-i", stream.videoFile, "-map", "0:v:0", "-f", "image2pipe", "-c:v", "pam", "-pix_fmt", "rgba", "pipe:1" });
+            stream.videoNextFrame = 0;
+        }
+
+        // read the next frame from the pipe without holding the lock, and only convert it if it's wanted
+        FILE* pipe = stream.videoPipe;
+        int frameIndex = stream.videoNextFrame;
+        auto slotIt = stream.slots.find(frameIndex);
+        bool wanted = slotIt != stream.slots.end() && slotIt->second.loading;
+        int desiredWidth = stream.width;
+        int desiredHeight = stream.height;
+
+        lock.unlock();
+        int width = 0;
+        int height = 0;
+        bool read = pipe && ReadPAMHeader(pipe, width, height);
+        if (read)
+        {
+            frameU8.resize(width * height);
+            read = fread(frameU8.data(), sizeof(Data::ColorU8) * frameU8.size(), 1, pipe) == 1;
+        }
+        std::shared_ptr<FlipbookImage> decoded;
+        if (read && wanted)
+        {
+            std::vector<Data::ColorPMA> pixelsPMA(frameU8.size());
+            for (size_t index = 0; index < frameU8.size(); ++index)
+                pixelsPMA[index] = ColorU8ToColorPMA(frameU8[index]);
+
+            decoded = std::make_shared<FlipbookImage>();
+            ShrinkToMip(pixelsPMA, width, height, desiredWidth, desiredHeight, *decoded);
+        }
+        lock.lock();
+
+        Stream& readStream = m_streams[streamKey];
+
+        // If the read failed, the video ended early, or ffmpeg couldn't read it. Fail the frames waiting on it.
+        if (!read)
+        {
+            for (auto& pair : readStream.slots)
+            {
+                if (pair.second.loading && pair.first >= frameIndex)
+                {
+                    pair.second.loading = false;
+                    pair.second.failed = true;
+                }
+            }
+
+            if (readStream.videoPipe)
+                CloseProcessPipe(readStream.videoPipe);
+            readStream.videoPipe = nullptr;
+            readStream.videoNextFrame = 0;
+            m_imageLoaded.notify_all();
+
+            // if nothing could be read at all, don't start the video again for the earlier frames
+            if (frameIndex == 0)
+                break;
+            continue;
+        }
+
+        readStream.videoNextFrame++;
+
+        slotIt = readStream.slots.find(frameIndex);
+        if (decoded && slotIt != readStream.slots.end() && slotIt->second.loading)
+        {
+            slotIt->second.loading = false;
+            slotIt->second.decoded = decoded;
+            m_imageLoaded.notify_all();
+        }
+    }
+
+    m_streams[streamKey].videoDecoding = false;
+}
+
+void FlipbookStreams::LoadStreamImage(size_t streamKey, int imageIndex, std::unique_lock<std::mutex>& lock)
+{
+    Stream& stream = m_streams[streamKey];
+    if (!stream.videoFile.empty())
+    {
+        DecodeVideoFrames(streamKey, lock);
+        return;
+    }
+
+    std::string fileName = stream.fileNames[imageIndex];
+    int width = stream.width;
+    int height = stream.height;
+
+    // decode the image without holding the lock
+    lock.unlock();
+    std::shared_ptr<FlipbookImage> decoded = std::make_shared<FlipbookImage>();
+    bool loaded = DecodeImage(fileName, width, height, *decoded);
+    lock.lock();
+
+    // the stream is never removed while it has images loading, so it's still there
+    Slot& slot = m_streams[streamKey].slots[imageIndex];
+    slot.loading = false;
+    slot.failed = !loaded;
+    if (loaded)
+        slot.decoded = decoded;
+    m_imageLoaded.notify_all();
+}
+
+void FlipbookStreams::WorkerThread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_jobAdded.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+        if (m_stop)
+            return;
+
+        Job job = m_jobs.front();
+        m_jobs.pop_front();
+
+        if (m_streams.count(job.streamKey) == 0)
+            continue;
+
+        LoadStreamImage(job.streamKey, job.imageIndex, lock);
+    }
+}
+
+std::shared_ptr<const FlipbookImage> FlipbookStreams::GetImage(const Data::Document& document, const Data::EntityFlipbook& flipbook, int imageIndex, int width, int height)
+{
+    int imageCount = flipbook.videoFile.empty() ? (int)flipbook.fileNames.size() : flipbook.videoFrameCount;
+    if (imageIndex < 0 || imageIndex >= imageCount || width <= 0 || height <= 0)
+        return nullptr;
+
+    size_t streamKey = 0;
+    for (const std::string& fileName : flipbook.fileNames)
+        Hash(streamKey, fileName);
+    Hash(streamKey, flipbook.videoFile);
+    Hash(streamKey, flipbook.loop);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // start the background loaders the first time they are needed
+    if (m_workers.empty())
+    {
+        int workerCount = Max(omp_get_num_procs() / 4, 1);
+        for (int workerIndex = 0; workerIndex < workerCount; ++workerIndex)
+            m_workers.push_back(std::thread(&FlipbookStreams::WorkerThread, this));
+    }
+
+    // get or make the stream
+    auto GetStream = [&]() -> Stream&
+    {
+        auto streamIt = m_streams.find(streamKey);
+        if (streamIt == m_streams.end())
+        {
+            Stream newStream;
+            newStream.fileNames = flipbook.fileNames;
+            newStream.imageCount = imageCount;
+            newStream.videoFile = flipbook.videoFile;
+            newStream.ffmpeg = document.config.ffmpeg;
+            newStream.loop = flipbook.loop;
+            newStream.playhead = imageIndex;
+            streamIt = m_streams.insert({ streamKey, newStream }).first;
+        }
+        return streamIt->second;
+    };
+
+    m_useCount++;
+    RemoveIdleStreams();
+    Stream& stream = GetStream();
+    stream.lastUse = m_useCount;
+    stream.width = width;
+    stream.height = height;
+    MovePlayhead(streamKey, stream, imageIndex);
+
+    while (true)
+    {
+        // the slot may have been freed by another thread while waiting, so look it up each time
+        Slot& slot = GetStream().slots[imageIndex];
+        if (slot.decoded && slot.decoded->width == width && slot.decoded->height == height)
+            return slot.decoded;
+        if (slot.image && slot.image->width == width && slot.image->height == height)
+            return slot.image;
+
+        // resize the decoded image to the size asked for without holding the lock. Only the last size is kept, so the
+        // image at the old size is freed as soon as the size changes.
+        if (slot.decoded)
+        {
+            std::shared_ptr<const FlipbookImage> decoded = slot.decoded;
+            lock.unlock();
+            std::shared_ptr<const FlipbookImage> image = ResizeDecoded(*decoded, width, height);
+            lock.lock();
+
+            auto streamIt = m_streams.find(streamKey);
+            if (streamIt != m_streams.end())
+            {
+                auto slotIt = streamIt->second.slots.find(imageIndex);
+                if (slotIt != streamIt->second.slots.end() && slotIt->second.decoded == decoded)
+                    slotIt->second.image = image;
+            }
+            return image;
+        }
+
+        if (slot.failed)
+            return nullptr;
+
+        // if it's already being loaded, wait for it
+        if (slot.loading)
+        {
+            m_imageLoaded.wait(lock);
+            continue;
+        }
+
+        // otherwise load it on this thread
+        slot.loading = true;
+        LoadStreamImage(streamKey, imageIndex, lock);
+    }
+}
@@ -0,0 +1,105 @@
+// Streams the images of flipbooks, so that only the images near the playhead are in memory.
+// The images after the playhead are decoded on background threads before they are needed, and the images behind the
+// playhead are freed.
+// A flipbook's images either come from a list of image files, or from a video file, which is decoded in order by an
+// ffmpeg process writing raw frames to a pipe.
+// Images are decoded and shrunk to the smallest mip that is at least as large as the size last asked for, then resized
+// to the size asked for when they are used. A flipbook that changes size reuses the same stream and decoded images,
+// and an image in memory is at most about twice as wide and tall as it's drawn, no matter how large the source is.
+
+#pragma once
+
+#include "utils.h"
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+struct FlipbookImage
+{
+    int width = 0;
+    int height = 0;
+    std::vector<ColorPMA16> pixels;
+};
+
+class FlipbookStreams
+{
+public:
+
+    ~FlipbookStreams();
+
+    // Returns the image, decoding it now if it isn't ready yet. Returns nullptr if it couldn't be loaded.
+    // The image stays alive while the shared_ptr is held, even if the stream frees it.
+    std::shared_ptr<const FlipbookImage> GetImage(const Data::Document& document, const Data::EntityFlipbook& flipbook, int imageIndex, int width, int height);
+
+    // Returns how many frames are in a video file, or 0 if it can't be read
+    static int GetVideoFrameCount(const std::string& ffmpeg, const std::string& videoFile);
+
+    static FlipbookStreams& Get()
+    {
+        static FlipbookStreams flipbookStreams;
+        return flipbookStreams;
+    }
+
+private:
+
+    struct Slot
+    {
+        std::shared_ptr<const FlipbookImage> decoded; // the mip of the source, for the size asked for when decoded
+        std::shared_ptr<const FlipbookImage> image; // decoded resized to the last size asked for
+        bool loading = false;
+        bool failed = false;
+    };
+
+    struct Stream
+    {
+        std::vector<std::string> fileNames;
+        int imageCount = 0;
+        bool loop = false;
+        int width = 0; // the last size asked for
+        int height = 0;
+        int playhead = 0;
+        uint64_t lastUse = 0;
+        std::unordered_map<int, Slot> slots;
+
+        // video decoding. Only one thread reads from the pipe at a time.
+        std::string videoFile;
+        std::string ffmpeg;
+        FILE* videoPipe = nullptr;
+        int videoNextFrame = 0;
+        bool videoDecoding = false;
+    };
+
+    struct Job
+    {
+        size_t streamKey = 0;
+        int imageIndex = 0;
+    };
+
+    FlipbookStreams() = default;
+
+    int DistanceFromPlayhead(const Stream& stream, int imageIndex) const;
+    void MovePlayhead(size_t streamKey, Stream& stream, int imageIndex);
+    void RemoveIdleStreams();
+    void WorkerThread();
+    void DecodeVideoFrames(size_t streamKey, std::unique_lock<std::mutex>& lock);
+    void LoadStreamImage(size_t streamKey, int imageIndex, std::unique_lock<std::mutex>& lock);
+
+    static bool DecodeImage(const std::string& fileName, int width, int height, FlipbookImage& image);
+    static void ShrinkToMip(std::vector<Data::ColorPMA>& pixels, int sourceWidth, int sourceHeight, int width, int height, FlipbookImage& image);
+    static std::shared_ptr<const FlipbookImage> ResizeDecoded(const FlipbookImage& decoded, int width, int height);
+
+    std::mutex m_mutex;
+    std::condition_variable m_imageLoaded;
+    std::condition_variable m_jobAdded;
+
+    std::unordered_map<size_t, Stream> m_streams;
+    std::deque<Job> m_jobs;
+    std::vector<std::thread> m_workers;
+    uint64_t m_useCount = 0;
+    bool m_stop = false;
+};
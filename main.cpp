@@ -5,6 +5,7 @@
 #include <string>
 #include <array>
 #include <unordered_map>
+#include <unordered_set>
 #include <atomic>
 #include <chrono>
 #include <direct.h>
@@ -68,14 +69,95 @@ void CopyFile(const char* src, const char* dest)
     }
 }
 
+bool LoadDocument(const char* srcFile, Data::Document& document)
+{
+    // load the document
+    if (!ReadFromJSONFile(document, srcFile))
+        return false;
+
+    // load the config
+    if (!ReadFromJSONFile(document.config, "internal/config.json"))
+    {
+        printf("Could not load internal/config.json!");
+        return false;
+    }
+
+    // document validation and fixup
+    if (!ValidateAndFixupDocument(document))
+    {
+        printf("Document validation failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Renders every frame of a document without writing them out, so the CAS can record what data the document uses
+bool RenderDocumentForGarbageCollection(const char* srcFile)
+{
+    Data::Document document;
+    if (!LoadDocument(srcFile, document))
+        return false;
+
+    printf("Finding CAS data used by %s...\n", srcFile);
+
+    int framesTotal = TotalFrameCount(document);
+    std::vector<ThreadContext> threadContexts(omp_get_max_threads());
+    Context context;
+    std::atomic<bool> wasError(false);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int frameIndex = 0; frameIndex < framesTotal; ++frameIndex)
+    {
+        ThreadContext& threadContext = threadContexts[omp_get_thread_num()];
+        threadContext.threadId = omp_get_thread_num();
+
+        int recycledFrameIndex = -1;
+        size_t frameHash = 0;
+        if (!wasError && !RenderFrame(document, frameIndex, threadContext, context, recycledFrameIndex, frameHash))
+            wasError = true;
+    }
+
+    return !wasError;
+}
+
+int CollectGarbage(int argc, char** argv)
+{
+    size_t quotaMB = (argc > 2) ? (size_t)strtoull(argv[2], nullptr, 10) : 0;
+
+    // if documents are given, only keep the data that they use
+    std::unordered_set<size_t> keepKeys;
+    bool keepDocumentKeys = argc > 3;
+    if (keepDocumentKeys)
+    {
+        CAS::Get().StartRecording();
+        for (int argIndex = 3; argIndex < argc; ++argIndex)
+        {
+            if (!RenderDocumentForGarbageCollection(argv[argIndex]))
+            {
+                CAS::Get().StopRecording();
+                printf("Could not render %s, so nothing was deleted\n", argv[argIndex]);
+                return 1;
+            }
+        }
+        keepKeys = CAS::Get().StopRecording();
+    }
+
+    return CAS::Get().CollectGarbage(quotaMB * 1024 * 1024, keepDocumentKeys ? &keepKeys : nullptr) ? 0 : 1;
+}
+
 int main(int argc, char** argv)
 {
     if (argc < 2)
     {
         printf("Usage:\n    animatron <sourcefile> <destfile>\n\n    <sourcefile> is a json file describing the animation.\n    <destfile> is the name and location of the mp4 output file.\n\n");
+        printf("    animatron -gc <quotaMB> [<sourcefile> ...]\n\n    Deletes the least recently used data in the CAS until it fits in <quotaMB> megabytes. 0 means no limit.\n    If source files are given, only the data they use is kept.\n\n");
         return 1;
     }
 
+    if (!strcmp(argv[1], "-gc"))
+        return CollectGarbage(argc, argv);
+
     // handle command line arguments
     const char* srcFile = argv[1];
     const char* destFile = nullptr;
@@ -107,24 +189,8 @@ int main(int argc, char** argv)
 
     // load the document
     Data::Document document;
-    if (!ReadFromJSONFile(document, srcFile))
-    {
-        return 1;
-    }
-
-    // load the config
-    if (!ReadFromJSONFile(document.config, "internal/config.json"))
-    {
-        printf("Could not load internal/config.json!");
+    if (!LoadDocument(srcFile, document))
         return 1;
-    }
-
-    // document validation and fixup
-    if (!ValidateAndFixupDocument(document))
-    {
-        printf("Document validation failed\n");
-        return 1;
-    }
 
     // report what we are doing
     int framesTotal = TotalFrameCount(document);
@@ -135,6 +201,12 @@ int main(int argc, char** argv)
     printf("  %i frames rendered at %i x %i with %i samples per pixel, output to %i x %i\n",
         framesTotal, document.renderSizeX, document.renderSizeY, document.samplesPerPixel,
         document.outputSizeX, document.outputSizeY);
+    {
+        int staticFrames = 0;
+        for (const Data::RuntimeFrameRange& range : document.staticFrameRanges)
+            staticFrames += range.lastFrame - range.firstFrame;
+        printf("  %i frames can be recycled from %i static frame ranges without evaluation\n", staticFrames, (int)document.staticFrameRanges.size());
+    }
 
     // Render and write out each frame multithreadedly
     std::vector<ThreadContext> threadContexts(omp_get_max_threads());
@@ -247,6 +319,10 @@ int main(int argc, char** argv)
         float secondsPerFrame = seconds.count() / float(framesTotal);
         printf("Render Time: %0.3f seconds.\n  %0.3f seconds per frame average wall time (more threads make this lower)\n  %0.3f seconds per frame average actual computation time\n", seconds.count(), secondsPerFrame, secondsPerFrame * float(threadContexts.size()));
         printf("frames rendered: %i\nframes recycled: %i\n", framesRendered.load(), framesRecycled.load());
+
+        CAS::Get().ReportStats();
+        if (!CAS::Get().WriteStats("build/casstats.json"))
+            printf("Warning: Could not write build/casstats.json\n");
     }
 
     if (wasError)
@@ -351,8 +427,8 @@ TODO:
 * generate html documentation of file format
 * whitted and path traced raytracing.  have lights / emissive i guess. unlit if no lights in whitted?
 * sample cube maps from raytracing i guess
-* other 2d sample sequences: R2, white noise, regular, jittered grid, bayer
-! other subpixel jitter types to implement: white noise, projective blue noise, R2, sobol.
+* other 2d sample sequences: white noise, regular, jittered grid, bayer
+! other subpixel jitter types to implement: white noise, projective blue noise.
  * may also have some that animate over time to make the noise good over time
 * if init times become a problem, could do content addressable storage and cache things like latex images.
 * is there something we can use besides system() which can hide the output of the latex commands?
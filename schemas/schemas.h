@@ -82,6 +82,9 @@ STRUCT_END()
 
 ENUM_BEGIN(Data, SamplesType2D, "Type of 2d samples generated")
     ENUM_ITEM(MitchellsBlueNoise, "2d blue noise, made with Mitchell's Best Candidate algorithm. Good at hiding the error in low sample counts.")
+    ENUM_ITEM(R2, "The R2 low discrepancy sequence. Converges faster than blue noise, but the error is more structured.")
+    ENUM_ITEM(OwenScrambledSobol, "2d Sobol, Owen scrambled. Converges fast, especially at power of 2 sample counts.")
+    ENUM_ITEM(RotatedBlueNoise, "MitchellsBlueNoise, with each pixel's samples offset by a blue noise texture, so the error between pixels is blue noise too. Looks good at low sample counts.")
 ENUM_END()
 
 ENUM_BEGIN(Data, DigitalDissolveType, "Types of digital dissolve")
@@ -199,6 +202,8 @@ STRUCT_BEGIN(Data, EntityFlipbook, "An list of image files, played in sequence")
     STRUCT_FIELD(Color, tint, Data::Color{ 1.0f COMMA 1.0f COMMA 1.0f COMMA 1.0f }, "A color to multiply the image by")
     STRUCT_FIELD(float, timePerFrame, 0.2f, "Time per frame in seconds. 0 means a single frame.")
     STRUCT_FIELD(bool, loop, true, "Whether to loop or not")
+    STRUCT_FIELD(std::string, videoFile, "", "A video file to play the frames of, instead of fileNames. Decoded with the ffmpeg from config.json.")
+    STRUCT_FIELD_NO_SERIALIZE(int, videoFrameCount, 0, "How many frames videoFile has. Calculated in the initialization function.")
 STRUCT_END()
 
 // ----------------------------- Entity -----------------------------
@@ -239,6 +244,15 @@ STRUCT_BEGIN(Data, RuntimeEntityTimeline, "")
     STRUCT_FIELD_NO_SERIALIZE(std::vector<Data::RuntimeEntityTimelineKeyframe>, keyFrames, std::vector<Data::RuntimeEntityTimelineKeyframe>(), "")
 STRUCT_END()
 
+STRUCT_BEGIN(Data, RuntimeEntityTimelineBucket, "The entity timelines which exist at some point during a span of frames")
+    STRUCT_FIELD_NO_SERIALIZE(std::vector<Data::RuntimeEntityTimeline*>, timelines, std::vector<Data::RuntimeEntityTimeline*>(), "Sorted by zorder ascending")
+STRUCT_END()
+
+STRUCT_BEGIN(Data, RuntimeFrameRange, "An inclusive range of frames")
+    STRUCT_FIELD_NO_SERIALIZE(int, firstFrame, 0, "")
+    STRUCT_FIELD_NO_SERIALIZE(int, lastFrame, 0, "")
+STRUCT_END()
+
 // ----------------------------- Application Settings File -----------------------------
 
 STRUCT_BEGIN(Data, Configuration, "Application configuration, read from config.json")
@@ -248,6 +262,8 @@ STRUCT_BEGIN(Data, Configuration, "Application configuration, read from config.j
 
     STRUCT_FIELD(std::string, latexbinaries, "", "The path to where pdflatex.exe and dvipng.exe are. Used to render text and formulas. MikTex suggested!")
     STRUCT_FIELD(std::string, ffmpeg, "", "The path to where ffmpeg.exe is, including the exe name. Used to assemble frames into the final video. ")
+    STRUCT_FIELD(int, latexJobs, 0, "How many latex images to make at once when loading a document. 0 means one per CPU core.")
+    STRUCT_FIELD(int, casMemoryMB, 4096, "How much memory in megabytes cached data can use, before the least recently used data is freed. 0 means no limit.")
 
     STRUCT_FIELD(ImageFileType, writeFrames, Data::ImageFileType::PNG, "The file type to write frames as. PNG takes more CPU to compress before write, BMP takes more disk bandwidth to write.")
 STRUCT_END()
@@ -285,6 +301,9 @@ STRUCT_BEGIN(Data, Document, "A document")
     // timeline for entities
     STRUCT_FIELD_NO_SERIALIZE(std::unordered_map<std::string COMMA Data::RuntimeEntityTimeline>, runtimeEntityTimelinesMap, std::unordered_map<std::string COMMA Data::RuntimeEntityTimeline>(), "")
     STRUCT_FIELD_NO_SERIALIZE(std::vector<Data::RuntimeEntityTimeline*>, runtimeEntityTimelines, std::vector<Data::RuntimeEntityTimeline*>(), "")
+    STRUCT_FIELD_NO_SERIALIZE(int, timelineBucketFrames, 0, "How many frames are in each of runtimeEntityTimelineBuckets")
+    STRUCT_FIELD_NO_SERIALIZE(std::vector<Data::RuntimeEntityTimelineBucket>, runtimeEntityTimelineBuckets, std::vector<Data::RuntimeEntityTimelineBucket>(), "runtimeEntityTimelines split up by the frames they exist in, so rendering a frame only looks at the entities that could exist.")
+    STRUCT_FIELD_NO_SERIALIZE(std::vector<Data::RuntimeFrameRange>, staticFrameRanges, std::vector<Data::RuntimeFrameRange>(), "Ranges of frames where nothing visible changes, found by analyzing the timelines at load time. Sorted by frame.")
 
     STRUCT_DYNAMIC_ARRAY(Entity, entities, "")
     STRUCT_DYNAMIC_ARRAY(KeyFrame, keyFrames, "")
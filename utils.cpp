@@ -1,5 +1,33 @@
 #include "utils.h"
 #include <random>
+#include "stb/stb_image.h"
+#include "schemas/hash.h"
+#include "cas.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <unordered_map>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define USE_SSE 1
+#include <emmintrin.h>
+#else
+#define USE_SSE 0
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
 
 template <typename T>
 void ResizeInternal(std::vector<T> &pixels, int sizeX, int sizeY, int desiredSizeX, int desiredSizeY)
@@ -171,6 +199,127 @@ void Resize(std::vector<Data::ColorPMA>& pixels, int sizeX, int sizeY, int desir
     ResizeInternal(pixels, sizeX, sizeY, desiredSizeX, desiredSizeY);
 }
 
+int GetMipCount(int sizeX, int sizeY)
+{
+    int mipCount = 1;
+    while (GetMipSize(sizeX, mipCount - 1) > 1 || GetMipSize(sizeY, mipCount - 1) > 1)
+        mipCount++;
+    return mipCount;
+}
+
+int ChooseMip(int sizeX, int sizeY, int desiredSizeX, int desiredSizeY)
+{
+    int mipCount = GetMipCount(sizeX, sizeY);
+    int mip = 0;
+    while (mip + 1 < mipCount && GetMipSize(sizeX, mip + 1) >= desiredSizeX && GetMipSize(sizeY, mip + 1) >= desiredSizeY)
+        mip++;
+    return mip;
+}
+
+void MakeMips(std::vector<Data::ColorPMA>& pixels, int sizeX, int sizeY, int lastMip, std::vector<Data::ColorPMA>* mips)
+{
+    if (mips)
+        mips->insert(mips->end(), pixels.begin(), pixels.end());
+
+    for (int mip = 1; mip <= lastMip; ++mip)
+    {
+        int mipSizeX = GetMipSize(sizeX, mip);
+        int mipSizeY = GetMipSize(sizeY, mip);
+        Resize(pixels, GetMipSize(sizeX, mip - 1), GetMipSize(sizeY, mip - 1), mipSizeX, mipSizeY);
+        if (mips)
+            mips->insert(mips->end(), pixels.begin(), pixels.end());
+    }
+}
+
+bool LoadImagePMA(const char* fileName, std::vector<Data::ColorPMA>& pixels, int& width, int& height)
+{
+    int channels;
+    stbi_uc* filePixels = stbi_load(fileName, &width, &height, &channels, 4);
+    if (filePixels == nullptr)
+    {
+        printf("could not load file %s\n", fileName);
+        return false;
+    }
+
+    pixels.resize(width * height);
+    const Data::ColorU8* pixel = (Data::ColorU8*)filePixels;
+    for (size_t index = 0; index < width * height; ++index)
+    {
+        pixels[index] = ColorU8ToColorPMA(*pixel);
+        pixel++;
+    }
+
+    stbi_image_free(filePixels);
+    return true;
+}
+
+void ProjectPoints3D(const std::vector<Data::Point3D>& points, const Data::Point3D& offset, const Data::Matrix4x4& mtx, std::vector<Data::Point4D>& results)
+{
+    // With row vectors, the result is the sum of the matrix rows, weighted by the point's x, y, z and 1.
+    // Fold the offset into the last row so it's only done once.
+    Data::Point4D rowW;
+    rowW.X = mtx.W.X + offset.X * mtx.X.X + offset.Y * mtx.Y.X + offset.Z * mtx.Z.X;
+    rowW.Y = mtx.W.Y + offset.X * mtx.X.Y + offset.Y * mtx.Y.Y + offset.Z * mtx.Z.Y;
+    rowW.Z = mtx.W.Z + offset.X * mtx.X.Z + offset.Y * mtx.Y.Z + offset.Z * mtx.Z.Z;
+    rowW.W = mtx.W.W + offset.X * mtx.X.W + offset.Y * mtx.Y.W + offset.Z * mtx.Z.W;
+
+    results.resize(points.size());
+
+#if USE_SSE
+    __m128 row0 = _mm_loadu_ps(&mtx.X.X);
+    __m128 row1 = _mm_loadu_ps(&mtx.Y.X);
+    __m128 row2 = _mm_loadu_ps(&mtx.Z.X);
+    __m128 row3 = _mm_loadu_ps(&rowW.X);
+    for (size_t index = 0; index < points.size(); ++index)
+    {
+        const Data::Point3D& point = points[index];
+        __m128 result = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(point.X), row0), _mm_mul_ps(_mm_set1_ps(point.Y), row1)),
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(point.Z), row2), row3)
+        );
+        _mm_storeu_ps(&results[index].X, result);
+    }
+#else
+    for (size_t index = 0; index < points.size(); ++index)
+    {
+        const Data::Point3D& point = points[index];
+        Data::Point4D& result = results[index];
+        result.X = point.X * mtx.X.X + point.Y * mtx.Y.X + point.Z * mtx.Z.X + rowW.X;
+        result.Y = point.X * mtx.X.Y + point.Y * mtx.Y.Y + point.Z * mtx.Z.Y + rowW.Y;
+        result.Z = point.X * mtx.X.Z + point.Y * mtx.Y.Z + point.Z * mtx.Z.Z + rowW.Z;
+        result.W = point.X * mtx.X.W + point.Y * mtx.Y.W + point.Z * mtx.Z.W + rowW.W;
+    }
+#endif
+}
+
+void BlendRow(Data::ColorPMA* dest, const ColorPMA16* src, int count, const Data::ColorPMA& tint)
+{
+    static_assert(sizeof(Data::ColorPMA) == sizeof(float) * 4, "ColorPMA is expected to be 4 packed floats");
+
+#if USE_SSE
+    // convert each 16 bit source pixel to float, scale and tint it with a single multiply, then blend it
+    const __m128 srcScale = _mm_setr_ps(tint.R / 65535.0f, tint.G / 65535.0f, tint.B / 65535.0f, tint.A / 65535.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128i zero = _mm_setzero_si128();
+    for (int index = 0; index < count; ++index)
+    {
+        __m128i srcU16 = _mm_loadl_epi64((const __m128i*)&src[index]);
+        __m128 srcColor = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(srcU16, zero)), srcScale);
+        __m128 srcAlpha = _mm_shuffle_ps(srcColor, srcColor, _MM_SHUFFLE(3, 3, 3, 3));
+
+        __m128 destColor = _mm_loadu_ps(&dest[index].R);
+        destColor = _mm_add_ps(srcColor, _mm_mul_ps(destColor, _mm_sub_ps(one, srcAlpha)));
+        _mm_storeu_ps(&dest[index].R, destColor);
+    }
+#else
+    for (int index = 0; index < count; ++index)
+        dest[index] = Blend(dest[index], FromColorPMA16(src[index]) * tint);
+#endif
+}
+
+// Bump this when any of the jitter sequences change
+static const int c_jitterSequenceVersion = 1;
+
 void MakeJitterSequence_MitchellsBlueNoise(Data::Document& document)
 {
     std::mt19937 rng;
@@ -205,43 +354,131 @@ void MakeJitterSequence_MitchellsBlueNoise(Data::Document& document)
     }
 }
 
+// http://extremelearning.com.au/unreasonable-effectiveness-of-quasirandom-sequences/
+void MakeJitterSequence_R2(Data::Document& document)
+{
+    static const double c_g = 1.32471795724474602596;
+    static const double c_a1 = 1.0 / c_g;
+    static const double c_a2 = 1.0 / (c_g * c_g);
+
+    for (uint32_t i = 0; i < document.samplesPerPixel; ++i)
+    {
+        double x = 0.5 + c_a1 * double(i);
+        double y = 0.5 + c_a2 * double(i);
+        document.jitterSequence.points.push_back(Data::Point2D{ float(x - floor(x)), float(y - floor(y)) });
+    }
+}
+
+static uint32_t ReverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling with a hash, from "Practical Hash-based Owen Scrambling" by Brent Burley
+// https://jcgt.org/published/0009/04/01/
+static uint32_t OwenScramble(uint32_t x, uint32_t seed)
+{
+    x = ReverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return ReverseBits(x);
+}
+
+void MakeJitterSequence_OwenScrambledSobol(Data::Document& document)
+{
+    // The first dimension is the Van der Corput sequence. The direction numbers of the second dimension are all 1.
+    uint32_t directions[32];
+    directions[0] = 0x80000000;
+    for (int bit = 1; bit < 32; ++bit)
+        directions[bit] = directions[bit - 1] ^ (directions[bit - 1] >> 1);
+
+    for (uint32_t i = 0; i < document.samplesPerPixel; ++i)
+    {
+        uint32_t x = ReverseBits(i);
+        uint32_t y = 0;
+        for (int bit = 0; bit < 32; ++bit)
+        {
+            if (i & (1u << bit))
+                y ^= directions[bit];
+        }
+
+        x = OwenScramble(x, 0x5EED0001);
+        y = OwenScramble(y, 0x5EED0002);
+
+        // use the top 24 bits, so the result is exact as a float, and less than 1
+        document.jitterSequence.points.push_back(Data::Point2D{ float(x >> 8) / 16777216.0f, float(y >> 8) / 16777216.0f });
+    }
+}
+
 bool MakeJitterSequence(Data::Document& document)
 {
+    document.jitterSequence.points.clear();
+
     if (document.samplesPerPixel == 1)
     {
         document.jitterSequence.points.push_back(Data::Point2D{0.5f, 0.5f});
         return true;
     }
 
-    switch (document.jitterSequenceType)
+    // the rotated blue noise points are the same as the blue noise points. They are offset per pixel when used.
+    Data::SamplesType2D sequenceType = document.jitterSequenceType;
+    if (sequenceType == Data::SamplesType2D::RotatedBlueNoise)
+        sequenceType = Data::SamplesType2D::MitchellsBlueNoise;
+
+    // Some sequences are slow to make, and they only depend on the type and count, so get them from the CAS
+    size_t hash = 0;
+    Hash(hash, "JitterSequence");
+    Hash(hash, c_jitterSequenceVersion);
+    Hash(hash, (int)sequenceType);
+    Hash(hash, document.samplesPerPixel);
+    CAS::Handle data = CAS::Get().Get(hash, CAS::KeyClass::JitterSequence);
+    if (data && data.Size() == document.samplesPerPixel * sizeof(Data::Point2D))
+    {
+        const Data::Point2D* points = data.As<Data::Point2D>();
+        document.jitterSequence.points.assign(points, points + document.samplesPerPixel);
+        return true;
+    }
+
+    switch (sequenceType)
     {
         case Data::SamplesType2D::MitchellsBlueNoise:
         {
             MakeJitterSequence_MitchellsBlueNoise(document);
             break;
         }
+        case Data::SamplesType2D::R2:
+        {
+            MakeJitterSequence_R2(document);
+            break;
+        }
+        case Data::SamplesType2D::OwenScrambledSobol:
+        {
+            MakeJitterSequence_OwenScrambledSobol(document);
+            break;
+        }
         default:
         {
             printf("Error: Unhandled jitter sequence type encountered!");
             return false;
         }
     }
+
+    CAS::Set(hash, CAS::KeyClass::JitterSequence, document.jitterSequence.points, false);
     return true;
 }
 
-void DrawLine(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, const Data::Point2D& A, const Data::Point2D& B, float width, const Data::ColorPMA& color)
+// Draws the line, with the sample loop specialized for the sample count. See DISPATCH_SAMPLE_COUNT.
+template <uint32_t SAMPLE_COUNT>
+static void DrawLineSamples(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, int minPixelX, int minPixelY, int maxPixelX, int maxPixelY, const Data::Point2D& A, const Data::Point2D& B, float width, const Data::ColorPMA& color)
 {
-    // Get a bounding box of the line
-    int minPixelX, minPixelY, maxPixelX, maxPixelY;
-    GetPixelBoundingBox_TwoPointsRadius(document, A.X, A.Y, B.X, B.Y, width, width, minPixelX, minPixelY, maxPixelX, maxPixelY);
-
-    // clip the bounding box to the screen
-    minPixelX = Clamp(minPixelX, 0, document.renderSizeX - 1);
-    maxPixelX = Clamp(maxPixelX, 0, document.renderSizeX - 1);
-    minPixelY = Clamp(minPixelY, 0, document.renderSizeY - 1);
-    maxPixelY = Clamp(maxPixelY, 0, document.renderSizeY - 1);
-
-    // Draw the line
+    JitterSamples<SAMPLE_COUNT> jitter(document);
     for (int iy = minPixelY; iy <= maxPixelY; ++iy)
     {
         Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX + minPixelX];
@@ -249,9 +486,10 @@ void DrawLine(const Data::Document& document, std::vector<Data::ColorPMA>& pixel
         {
             // do multiple jittered samples per pixel and integrate (average) the result
             Data::ColorPMA samplesColor;
-            for (uint32_t sampleIndex = 0; sampleIndex < document.samplesPerPixel; ++sampleIndex)
+            Data::Point2D jitterRotation = GetJitterRotation(document, ix, iy);
+            for (uint32_t sampleIndex = 0; sampleIndex < jitter.Count(); ++sampleIndex)
             {
-                Data::Point2D offset = document.jitterSequence.points[sampleIndex];
+                Data::Point2D offset = GetJitterOffset(jitter.points[sampleIndex], jitterRotation);
 
                 float canvasX, canvasY;
                 PixelToCanvas(document, (float)ix + offset.X, (float)iy + offset.Y, canvasX, canvasY);
@@ -260,10 +498,10 @@ void DrawLine(const Data::Document& document, std::vector<Data::ColorPMA>& pixel
 
                 if (distance < width)
                 {
-                    samplesColor.R += color.R / float(document.samplesPerPixel);
-                    samplesColor.G += color.G / float(document.samplesPerPixel);
-                    samplesColor.B += color.B / float(document.samplesPerPixel);
-                    samplesColor.A += color.A / float(document.samplesPerPixel);
+                    samplesColor.R += color.R / float(jitter.Count());
+                    samplesColor.G += color.G / float(jitter.Count());
+                    samplesColor.B += color.B / float(jitter.Count());
+                    samplesColor.A += color.A / float(jitter.Count());
                 }
             }
 
@@ -272,4 +510,369 @@ void DrawLine(const Data::Document& document, std::vector<Data::ColorPMA>& pixel
             pixel++;
         }
     }
-}
\ No newline at end of file
+}
+
+void DrawLine(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, const Data::Point2D& A, const Data::Point2D& B, float width, const Data::ColorPMA& color)
+{
+    // Get a bounding box of the line
+    int minPixelX, minPixelY, maxPixelX, maxPixelY;
+    GetPixelBoundingBox_TwoPointsRadius(document, A.X, A.Y, B.X, B.Y, width, width, minPixelX, minPixelY, maxPixelX, maxPixelY);
+
+    // clip the bounding box to the screen
+    minPixelX = Clamp(minPixelX, 0, document.renderSizeX - 1);
+    maxPixelX = Clamp(maxPixelX, 0, document.renderSizeX - 1);
+    minPixelY = Clamp(minPixelY, 0, document.renderSizeY - 1);
+    maxPixelY = Clamp(maxPixelY, 0, document.renderSizeY - 1);
+
+    // Draw the line
+    DISPATCH_SAMPLE_COUNT(document, DrawLineSamples, document, pixels, minPixelX, minPixelY, maxPixelX, maxPixelY, A, B, width, color);
+}
+
+// Draws the pixels of each tile that has segments in it, with the sample loop specialized for the sample count.
+// See DISPATCH_SAMPLE_COUNT.
+template <uint32_t SAMPLE_COUNT>
+static void DrawLineSegmentTiles(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, const std::vector<Data::Point2D>& segmentPoints, const std::vector<std::vector<uint32_t>>& tileSegments, int tilesX, int tilesY, int tileSize, float width, const Data::ColorPMA& color)
+{
+    JitterSamples<SAMPLE_COUNT> jitter(document);
+    float widthSquared = width * width;
+    for (int tileY = 0; tileY < tilesY; ++tileY)
+    {
+        for (int tileX = 0; tileX < tilesX; ++tileX)
+        {
+            const std::vector<uint32_t>& segments = tileSegments[tileY * tilesX + tileX];
+            if (segments.empty())
+                continue;
+
+            int minPixelX = tileX * tileSize;
+            int minPixelY = tileY * tileSize;
+            int maxPixelX = Min(minPixelX + tileSize, document.renderSizeX);
+            int maxPixelY = Min(minPixelY + tileSize, document.renderSizeY);
+
+            for (int iy = minPixelY; iy < maxPixelY; ++iy)
+            {
+                Data::ColorPMA* pixel = &pixels[iy * document.renderSizeX + minPixelX];
+                for (int ix = minPixelX; ix < maxPixelX; ++ix, ++pixel)
+                {
+                    // do multiple jittered samples per pixel and integrate (average) the result
+                    uint32_t coveredSamples = 0;
+                    Data::Point2D jitterRotation = GetJitterRotation(document, ix, iy);
+                    for (uint32_t sampleIndex = 0; sampleIndex < jitter.Count(); ++sampleIndex)
+                    {
+                        Data::Point2D offset = GetJitterOffset(jitter.points[sampleIndex], jitterRotation);
+
+                        float canvasX, canvasY;
+                        PixelToCanvas(document, (float)ix + offset.X, (float)iy + offset.Y, canvasX, canvasY);
+
+                        for (uint32_t segmentIndex : segments)
+                        {
+                            const Data::Point2D& A = segmentPoints[segmentIndex * 2 + 0];
+                            const Data::Point2D& B = segmentPoints[segmentIndex * 2 + 1];
+                            if (sdLineSquared({ A.X, A.Y }, { B.X, B.Y }, { canvasX, canvasY }) < widthSquared)
+                            {
+                                coveredSamples++;
+                                break;
+                            }
+                        }
+                    }
+
+                    // alpha blend the result in
+                    if (coveredSamples > 0)
+                        *pixel = Blend(*pixel, color * (float(coveredSamples) / float(jitter.Count())));
+                }
+            }
+        }
+    }
+}
+
+void DrawLineSegments(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, const std::vector<Data::Point2D>& segmentPoints, float width, const Data::ColorPMA& color)
+{
+    static const int c_tileSize = 16;
+
+    size_t segmentCount = segmentPoints.size() / 2;
+    if (segmentCount == 0)
+        return;
+
+    // put each segment into the screen tiles that its bounding box touches
+    int tilesX = (document.renderSizeX + c_tileSize - 1) / c_tileSize;
+    int tilesY = (document.renderSizeY + c_tileSize - 1) / c_tileSize;
+    std::vector<std::vector<uint32_t>> tileSegments(tilesX * tilesY);
+    for (size_t segmentIndex = 0; segmentIndex < segmentCount; ++segmentIndex)
+    {
+        const Data::Point2D& A = segmentPoints[segmentIndex * 2 + 0];
+        const Data::Point2D& B = segmentPoints[segmentIndex * 2 + 1];
+
+        int minPixelX, minPixelY, maxPixelX, maxPixelY;
+        GetPixelBoundingBox_TwoPointsRadius(document, A.X, A.Y, B.X, B.Y, width, width, minPixelX, minPixelY, maxPixelX, maxPixelY);
+
+        // skip segments that are completely off the screen
+        if (maxPixelX < 0 || maxPixelY < 0 || minPixelX >= document.renderSizeX || minPixelY >= document.renderSizeY)
+            continue;
+
+        int minTileX = Clamp(minPixelX, 0, document.renderSizeX - 1) / c_tileSize;
+        int maxTileX = Clamp(maxPixelX, 0, document.renderSizeX - 1) / c_tileSize;
+        int minTileY = Clamp(minPixelY, 0, document.renderSizeY - 1) / c_tileSize;
+        int maxTileY = Clamp(maxPixelY, 0, document.renderSizeY - 1) / c_tileSize;
+
+        for (int tileY = minTileY; tileY <= maxTileY; ++tileY)
+            for (int tileX = minTileX; tileX <= maxTileX; ++tileX)
+                tileSegments[tileY * tilesX + tileX].push_back((uint32_t)segmentIndex);
+    }
+
+    // Draw the pixels of each tile that has segments in it. A sample is covered if it's close enough to any segment,
+    // so joints between segments are only blended once.
+    DISPATCH_SAMPLE_COUNT(document, DrawLineSegmentTiles, document, pixels, segmentPoints, tileSegments, tilesX, tilesY, c_tileSize, width, color);
+}
+
+#ifdef _WIN32
+// Quotes an argument so that the program's command line parsing gives it back unchanged. Backslashes are only special
+// when they come before a quote, so those are doubled, and quotes are escaped.
+static std::string QuoteArgument(const std::string& argument)
+{
+    std::string quoted = "\"";
+    size_t backslashes = 0;
+    for (char c : argument)
+    {
+        if (c == '\\')
+        {
+            backslashes++;
+            continue;
+        }
+
+        if (c == '"')
+            backslashes = backslashes * 2 + 1;
+        quoted.append(backslashes, '\\');
+        quoted += c;
+        backslashes = 0;
+    }
+    quoted.append(backslashes * 2, '\\');
+    quoted += "\"";
+    return quoted;
+}
+
+// windows wants a single command line, with the program as the first argument. It's given to CreateProcess, not a
+// shell, so nothing in it is expanded.
+static std::string MakeCommandLine(const std::string& program, const std::vector<std::string>& arguments)
+{
+    std::string commandLine = QuoteArgument(program);
+    for (const std::string& argument : arguments)
+        commandLine += " " + QuoteArgument(argument);
+    return commandLine;
+}
+#else
+static std::vector<char*> MakeArgv(const std::string& program, const std::vector<std::string>& arguments)
+{
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for (const std::string& argument : arguments)
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    argv.push_back(nullptr);
+    return argv;
+}
+
+static bool WaitForProcess(pid_t pid, int& status)
+{
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+#endif
+
+bool RunProcess(const std::string& program, const std::vector<std::string>& arguments)
+{
+#ifdef _WIN32
+    std::string commandLine = MakeCommandLine(program, arguments);
+
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    ZeroMemory(&pi, sizeof(pi));
+
+    if (!CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, FALSE, CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi))
+        return false;
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+
+    DWORD exitCode = 1;
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+
+    return exitCode == 0;
+#else
+    std::vector<char*> argv = MakeArgv(program, arguments);
+
+    pid_t pid;
+    if (posix_spawnp(&pid, program.c_str(), nullptr, nullptr, argv.data(), environ) != 0)
+        return false;
+
+    int status = 0;
+    if (!WaitForProcess(pid, status))
+        return false;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+// The processes started by OpenProcessPipe, so CloseProcessPipe can wait for them.
+// The lock is also held while a pipe is made and its process started, so that no other pipe's process inherits the
+// write end of the pipe, which would keep the pipe from ever reaching the end of the file.
+static std::mutex s_processPipesLock;
+#ifdef _WIN32
+static std::unordered_map<FILE*, HANDLE> s_processPipes;
+#else
+static std::unordered_map<FILE*, pid_t> s_processPipes;
+#endif
+
+FILE* OpenProcessPipe(const std::string& program, const std::vector<std::string>& arguments)
+{
+    std::lock_guard<std::mutex> lock(s_processPipesLock);
+
+#ifdef _WIN32
+    // make a pipe, where only the write end is inherited by the process, as its standard output
+    SECURITY_ATTRIBUTES sa;
+    ZeroMemory(&sa, sizeof(sa));
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = TRUE;
+
+    HANDLE readHandle, writeHandle;
+    if (!CreatePipe(&readHandle, &writeHandle, &sa, 0))
+        return nullptr;
+    SetHandleInformation(readHandle, HANDLE_FLAG_INHERIT, 0);
+
+    std::string commandLine = MakeCommandLine(program, arguments);
+
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput = writeHandle;
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    ZeroMemory(&pi, sizeof(pi));
+
+    BOOL started = CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, TRUE, CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi);
+    CloseHandle(writeHandle);
+    if (!started)
+    {
+        CloseHandle(readHandle);
+        return nullptr;
+    }
+    CloseHandle(pi.hThread);
+
+    FILE* file = nullptr;
+    int fd = _open_osfhandle((intptr_t)readHandle, _O_RDONLY | _O_BINARY);
+    if (fd >= 0)
+        file = _fdopen(fd, "rb");
+    if (!file)
+    {
+        if (fd >= 0)
+            _close(fd);
+        else
+            CloseHandle(readHandle);
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        CloseHandle(pi.hProcess);
+        return nullptr;
+    }
+
+    s_processPipes[file] = pi.hProcess;
+    return file;
+#else
+    // make a pipe that isn't inherited, and give the write end to the process as its standard output
+    int fds[2];
+    if (pipe(fds) != 0)
+        return nullptr;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t fileActions;
+    posix_spawn_file_actions_init(&fileActions);
+    posix_spawn_file_actions_adddup2(&fileActions, fds[1], STDOUT_FILENO);
+
+    std::vector<char*> argv = MakeArgv(program, arguments);
+
+    pid_t pid;
+    bool started = posix_spawnp(&pid, program.c_str(), &fileActions, nullptr, argv.data(), environ) == 0;
+    posix_spawn_file_actions_destroy(&fileActions);
+    close(fds[1]);
+    if (!started)
+    {
+        close(fds[0]);
+        return nullptr;
+    }
+
+    FILE* file = fdopen(fds[0], "r");
+    if (!file)
+    {
+        close(fds[0]);
+        int status = 0;
+        WaitForProcess(pid, status);
+        return nullptr;
+    }
+
+    s_processPipes[file] = pid;
+    return file;
+#endif
+}
+
+void CloseProcessPipe(FILE* pipe)
+{
+#ifdef _WIN32
+    HANDLE process = nullptr;
+#else
+    pid_t process = 0;
+#endif
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(s_processPipesLock);
+        auto it = s_processPipes.find(pipe);
+        if (it != s_processPipes.end())
+        {
+            process = it->second;
+            found = true;
+            s_processPipes.erase(it);
+        }
+    }
+
+    // closing the pipe first makes a process that is still writing to it stop
+    fclose(pipe);
+    if (!found)
+        return;
+
+#ifdef _WIN32
+    WaitForSingleObject(process, INFINITE);
+    CloseHandle(process);
+#else
+    int status = 0;
+    WaitForProcess(process, status);
+#endif
+}
+
+int GetPID()
+{
+#ifdef _WIN32
+    return (int)GetCurrentProcessId();
+#else
+    return (int)getpid();
+#endif
+}
+
+bool GetFileModifiedTime(const char* fileName, int64_t& modifiedTime)
+{
+#ifdef _WIN32
+    struct _stat64 fileStat;
+    if (_stat64(fileName, &fileStat) != 0)
+        return false;
+#else
+    struct stat fileStat;
+    if (stat(fileName, &fileStat) != 0)
+        return false;
+#endif
+    modifiedTime = (int64_t)fileStat.st_mtime;
+    return true;
+}
@@ -4,6 +4,7 @@
 #include "math.h"
 #include "vectormath.h"
 #include "reflectedvectormath.h"
+#include <cstdio>
 
 // more sdf's here: https://www.iquilezles.org/www/articles/distfunctions2d/distfunctions2d.htm
 inline float sdLine(vec2 a, vec2 b, vec2 pixel)
@@ -14,6 +15,16 @@ inline float sdLine(vec2 a, vec2 b, vec2 pixel)
     return Length(pa - ba * h);
 }
 
+// squared distance to a line segment. Safe to call with a zero length segment.
+inline float sdLineSquared(vec2 a, vec2 b, vec2 pixel)
+{
+    vec2 pa = pixel - a;
+    vec2 ba = b - a;
+    float baLengthSquared = Dot(ba, ba);
+    float h = (baLengthSquared > 0.0f) ? Clamp(Dot(pa, ba) / baLengthSquared, 0.0f, 1.0f) : 0.0f;
+    return LengthSquared(pa - ba * h);
+}
+
 inline float sdBox(vec2 pixel, vec2 boxPos, vec2 boxRadius)
 {
     vec2 d = Abs(pixel - boxPos) - boxRadius;
@@ -278,13 +289,163 @@ inline Data::ColorPMA Blend(const Data::ColorPMA& out, const Data::ColorPMA& in)
     return ret;
 }
 
+// A pre multiplied alpha linear color stored as 16 bit unorm. Half the size of ColorPMA, for storing images.
+struct ColorPMA16
+{
+    uint16_t R, G, B, A;
+};
+
+inline ColorPMA16 ToColorPMA16(const Data::ColorPMA& color)
+{
+    ColorPMA16 ret;
+    ret.R = (uint16_t)(Clamp(color.R, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    ret.G = (uint16_t)(Clamp(color.G, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    ret.B = (uint16_t)(Clamp(color.B, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    ret.A = (uint16_t)(Clamp(color.A, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    return ret;
+}
+
+inline Data::ColorPMA FromColorPMA16(const ColorPMA16& color)
+{
+    Data::ColorPMA ret;
+    ret.R = float(color.R) / 65535.0f;
+    ret.G = float(color.G) / 65535.0f;
+    ret.B = float(color.B) / 65535.0f;
+    ret.A = float(color.A) / 65535.0f;
+    return ret;
+}
+
+// Blends count src pixels, multiplied by tint, over the dest pixels. Uses SSE when available.
+void BlendRow(Data::ColorPMA* dest, const ColorPMA16* src, int count, const Data::ColorPMA& tint);
+
+// Transforms points (plus an offset) by a matrix, giving homogeneous results, without the homogeneous divide.
+// Uses SSE when available.
+void ProjectPoints3D(const std::vector<Data::Point3D>& points, const Data::Point3D& offset, const Data::Matrix4x4& mtx, std::vector<Data::Point4D>& results);
+
 void Resize(std::vector<Data::Color>& pixels, int sizeX, int sizeY, int desiredSizeX, int desiredSizeY);
 void Resize(std::vector<Data::ColorPMA>& pixels, int sizeX, int sizeY, int desiredSizeX, int desiredSizeY);
 
+// Mips are a chain of images that each halve the size of the last, until the last one is 1x1
+int GetMipCount(int sizeX, int sizeY);
+inline int GetMipSize(int size, int mip) { return Max(size >> mip, 1); }
+
+// Returns the smallest mip that is at least as large as the desired size. Resizing from that mip never shrinks by more
+// than half, so the cost is proportional to the desired size, not the size of the image.
+int ChooseMip(int sizeX, int sizeY, int desiredSizeX, int desiredSizeY);
+
+// Shrinks the pixels to half size, lastMip times, leaving them as that mip.
+// If mips isn't null, every mip from 0 to lastMip is appended to it.
+void MakeMips(std::vector<Data::ColorPMA>& pixels, int sizeX, int sizeY, int lastMip, std::vector<Data::ColorPMA>* mips);
+
+inline Data::ColorPMA ColorU8ToColorPMA(const Data::ColorU8& pixel)
+{
+    Data::Color color{ float(pixel.R) / 255.0f, float(pixel.G) / 255.0f, float(pixel.B) / 255.0f, float(pixel.A) / 255.0f };
+    color.R = SRGBToLinear(color.R);
+    color.G = SRGBToLinear(color.G);
+    color.B = SRGBToLinear(color.B);
+    color.A = SRGBToLinear(color.A);
+    return ToPremultipliedAlpha(color);
+}
+
+// Loads an image file, converting it from sRGB to linear pre multiplied alpha
+bool LoadImagePMA(const char* fileName, std::vector<Data::ColorPMA>& pixels, int& width, int& height);
+
 bool MakeJitterSequence(Data::Document& document);
 
+// Some jitter sequences are rotated (offset, wrapping around) per pixel by the blue noise texture.
+// Get the rotation once per pixel, then get the offset of each sample with it.
+// The blue noise texture is loaded by ValidateAndFixupDocument before the document is rendered.
+inline Data::Point2D GetJitterRotation(const Data::Document& document, int pixelX, int pixelY)
+{
+    if (document.jitterSequenceType != Data::SamplesType2D::RotatedBlueNoise)
+        return Data::Point2D{ 0.0f, 0.0f };
+
+    // unsigned, so pixels at negative coordinates still index inside the texture
+    uint32_t noiseX = uint32_t(pixelX) % uint32_t(document.blueNoiseWidth);
+    uint32_t noiseY = uint32_t(pixelY) % uint32_t(document.blueNoiseHeight);
+    const Data::ColorU8& noise = document.blueNoisePixels[noiseY * document.blueNoiseWidth + noiseX];
+    return Data::Point2D{ float(noise.R) / 256.0f, float(noise.G) / 256.0f };
+}
+
+inline Data::Point2D GetJitterOffset(const Data::Point2D& point, const Data::Point2D& rotation)
+{
+    Data::Point2D offset = point;
+    offset.X += rotation.X;
+    offset.Y += rotation.Y;
+    if (offset.X >= 1.0f)
+        offset.X -= 1.0f;
+    if (offset.Y >= 1.0f)
+        offset.Y -= 1.0f;
+    return offset;
+}
+
+// The jitter offsets of the samples in a pixel, for sample loops templated on the sample count. For the common counts,
+// the offsets are copied out of the document, so the compiler knows how many there are and can fully unroll the
+// sample loop, and doesn't have to reload them after every write to the pixels.
+// SAMPLE_COUNT 0 is the fallback for any other count, which reads them from the document.
+template <uint32_t SAMPLE_COUNT>
+struct JitterSamples
+{
+    JitterSamples(const Data::Document& document)
+    {
+        for (uint32_t sampleIndex = 0; sampleIndex < SAMPLE_COUNT; ++sampleIndex)
+            points[sampleIndex] = document.jitterSequence.points[sampleIndex];
+    }
+
+    uint32_t Count() const { return SAMPLE_COUNT; }
+
+    Data::Point2D points[SAMPLE_COUNT];
+};
+
+template <>
+struct JitterSamples<0>
+{
+    JitterSamples(const Data::Document& document)
+        : points(document.jitterSequence.points.data())
+        , count(document.samplesPerPixel)
+    {
+    }
+
+    uint32_t Count() const { return count; }
+
+    const Data::Point2D* points;
+    uint32_t count;
+};
+
+// Calls FUNCTION<SAMPLE_COUNT>(...), where FUNCTION makes a JitterSamples<SAMPLE_COUNT> for its sample loops.
+// The common sample counts get their own specialization, and the rest use FUNCTION<0>.
+#define DISPATCH_SAMPLE_COUNT(DOCUMENT, FUNCTION, ...) \
+    switch ((DOCUMENT).samplesPerPixel) \
+    { \
+        case 1: FUNCTION<1>(__VA_ARGS__); break; \
+        case 4: FUNCTION<4>(__VA_ARGS__); break; \
+        case 8: FUNCTION<8>(__VA_ARGS__); break; \
+        case 16: FUNCTION<16>(__VA_ARGS__); break; \
+        case 32: FUNCTION<32>(__VA_ARGS__); break; \
+        default: FUNCTION<0>(__VA_ARGS__); break; \
+    }
+
 void DrawLine(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, const Data::Point2D& A, const Data::Point2D& B, float width, const Data::ColorPMA& color);
 
+// Draws many line segments in one pass, blending each pixel once. segmentPoints has two points per segment.
+void DrawLineSegments(const Data::Document& document, std::vector<Data::ColorPMA>& pixels, const std::vector<Data::Point2D>& segmentPoints, float width, const Data::ColorPMA& color);
+
+// Runs a program and waits for it to finish. The program is looked up in the path if it has no directory.
+// Returns false if it could not be started, or if it returned a non zero exit code.
+bool RunProcess(const std::string& program, const std::vector<std::string>& arguments);
+
+// Starts a program and returns a pipe to read its standard output from, or nullptr if it could not be started.
+FILE* OpenProcessPipe(const std::string& program, const std::vector<std::string>& arguments);
+
+// Closes a pipe from OpenProcessPipe, waiting for the program to exit.
+void CloseProcessPipe(FILE* pipe);
+
+// Returns the id of this process
+int GetPID();
+
+// Gets the last time a file was modified, in seconds like time(). Returns false if the file doesn't exist.
+bool GetFileModifiedTime(const char* fileName, int64_t& modifiedTime);
+
 inline void Fill(std::vector<Data::ColorPMA>& pixels, const Data::Color& color)
 {
     Data::ColorPMA colorPMA = ToPremultipliedAlpha(color);